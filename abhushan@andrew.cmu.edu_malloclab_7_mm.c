@@ -5,16 +5,73 @@
  *I have removed footers from allocated blocks and instead save that 
  *information in the lower order bit of the next block. Also to improve 
  *performance I have used Segregated list
+ *The segregated lists are indexed two-level (TLSF style): the first level
+ *is the power of two range of the size and the second level splits every
+ *range into SL_INDEX_COUNT linear classes. A bitmap per level records the
+ *non empty lists, so finding a list that fits is a couple of bit scans
+ *instead of a walk over the lists.
+ *Memory is split into arenas, independent heaps with their own lock and
+ *segregated lists. The main arena grows through mem_sbrk, the others each
+ *own an aligned reservation so that free() finds the owner of a block from
+ *its address. Threads are spread over the arenas round-robin. In front of
+ *them every thread keeps a cache (tcache) of recently freed small blocks per
+ *size class; those blocks stay marked allocated in the heap, so the common
+ *malloc/free pair only touches thread local data. Caches are refilled from
+ *and flushed to the arenas in batches under their locks.
+ *Under a best fit policy large free blocks are kept in a red-black tree
+ *ordered by size and address instead, so the smallest fitting block is
+ *found in logarithmic time.
+ *mm_stats reports the heap and free block layout of all arenas along with
+ *event counters: those of an arena are kept under its lock, the byte and
+ *call counts per thread, summed only when read.
+ *Requests of up to slab_max_size bytes do not use boundary tags at all: they
+ *are objects of a fixed size class packed into page sized slabs, carved from
+ *one reserved slab region. An object has no header; its size class is read
+ *from the header of the slab, found by masking the object's address.
+ *Requests of at least mmap_threshold bytes never enter the heap: each gets
+ *a mapping of its own, marked by the mmapped bit of its header, which free
+ *unmaps and realloc resizes with mremap.
+ *Memory of large free blocks is given back to the OS: the pages inside a
+ *free block of at least purge_threshold bytes are released with madvise,
+ *and a free block at the top of an arena beyond trim_threshold is cut back
+ *by lowering the arena's break. A purged bit in the header of a free block
+ *records that its pages were already released. With a dirty decay time set,
+ *this is deferred: large dirty free blocks are timestamped and released once
+ *they stayed free for that long, by an optional background thread or, when
+ *it is not running, from the allocation slow path every few hundred calls.
+ *calloc only clears what it has to: mapped blocks are fresh pages, and a
+ *zeroed bit in the header of a free block records that all of it but the
+ *header, footer and the first payload words is still zero from the OS.
+ *Aligned allocations carve a block at an aligned address out of a free
+ *block, the slack in front of and behind it going back on the lists.
+ *Regions bump allocate headerless objects out of chunks taken from the
+ *heap with malloc; resetting a region frees all its objects at once and
+ *keeps the chunks for reuse.
+ *The heap profiler samples an allocation about every MM_OPT_PROF_SAMPLE
+ *bytes and records its backtrace; a sampled block is a heap or mapped
+ *block with the sampled bit in its header, so free only looks it up in
+ *the profiler's tables when that bit is set.
   */
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "mm.h"
+#include "mm_ext.h"
 #include "memlib.h"
 
 
@@ -30,7 +87,8 @@
 #define dbg_printheap(...) print_heap(__VA_ARGS__)
 #else
 /* When debugging is disabled, no code gets generated */
-#define dbg_printf(...)
+/* The arguments of dbg_printf are still type checked, but not evaluated */
+#define dbg_printf(...) ((void)sizeof(printf(__VA_ARGS__)))
 #define dbg_assert(...)
 #define dbg_requires(...)
 #define dbg_ensures(...)
@@ -49,6 +107,18 @@
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
 
+#ifdef DRIVER
+/* Aliases for the extensions declared in mm_ext.h */
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define memalign mm_memalign
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define free_sized mm_free_sized
+#define free_aligned_sized mm_free_aligned_sized
+#define malloc_usable_size mm_malloc_usable_size
+#endif /* def DRIVER */
+
 /* What is the correct alignment? */
 #define ALIGNMENT 16
 
@@ -62,9 +132,197 @@ static const size_t chunksize = (1 << 12);    // requires (chunksize % 16 == 0)
 
 static const word_t alloc_mask = 0x1;
 static const word_t prev_alloc_mask = 0x2;
+static const word_t mmapped_mask = 0x4;
+static const word_t purged_mask = 0x8;//Only meaningful in free blocks
+static const word_t zeroed_mask = 0x4;//Free blocks only, shares mmapped_mask's bit
+static const word_t sampled_mask = 0x8;//Allocated blocks only, shares purged_mask's bit
 
 static const word_t size_mask = ~(word_t)0xF;
 
+/*
+ * Two-level segregated fit index. Sizes below small_block_size are kept in
+ * exact 16 byte classes; above that every power of two range [2^f, 2^(f+1))
+ * is split into SL_INDEX_COUNT equally sized classes. These have to be
+ * macros since they size the global arrays.
+ */
+#define ALIGNMENT_LOG2 4
+#define SL_INDEX_COUNT_LOG2 3
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGNMENT_LOG2)
+#define FL_INDEX_MAX 40                       // blocks up to 2^41 bytes
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 2)
+#define NUM_LISTS (FL_INDEX_COUNT * SL_INDEX_COUNT)
+
+static const size_t small_block_size = (size_t)1 << FL_INDEX_SHIFT;
+
+/*
+ * With a best fit policy, free blocks of at least tree_min_size bytes are
+ * kept in a red-black tree ordered by size, then address, instead of the
+ * lists. A tree node keeps its children where list blocks keep their
+ * links and its parent, tagged with its colour in bit 0, in the fourth
+ * payload word; the third one holds the decay timestamp.
+ */
+static const size_t tree_min_size = 1024;
+static const word_t tree_red_mask = 0x1;
+
+/*
+ * Fit index. The lists of a range of sizes (from small_block_size up to
+ * the tree) are mirrored in an array of their blocks' sizes and one of
+ * their addresses, mapped outside the heap, so that searching such a list
+ * for a fit reads consecutive sizes instead of following links through
+ * the blocks. A list block keeps its slot in its fourth payload word,
+ * where a tree node keeps its parent, so it is removed in constant time.
+ * If an array cannot grow, the list is searched by its links until it
+ * empties.
+ */
+static const uint32_t fit_index_initial = 256;//Entries of a list's first mapping
+
+/*
+ * Mapped blocks: the block header sits one word into the mapping so that
+ * the payload is aligned, or further for aligned requests, but always in
+ * the first page: the mapping starts at the header rounded down to a page.
+ * Like glibc, the threshold starts low and rises to the size of freed
+ * mapped blocks, up to mmap_threshold_max, so that sizes a program keeps
+ * reusing end up in the heap.
+ */
+static const size_t mmap_page_size = (1 << 12);
+static const size_t mmap_threshold_max = (size_t)32 << 20;
+
+/*
+ * Purging. PURGE_ADVICE is MADV_DONTNEED, which makes the kernel hand back
+ * zero pages on the next touch; MADV_FREE lets it reclaim lazily instead.
+ * The main arena grows through mem_sbrk, which cannot shrink, so its top
+ * block is purged rather than trimmed.
+ */
+#define PURGE_ADVICE MADV_DONTNEED
+
+/*
+ * Set SBRK_ZEROED if mem_sbrk hands out zero filled memory. Heap memory of
+ * the other arenas is zero when first reached, since it is either untouched
+ * or was purged with MADV_DONTNEED when the arena was trimmed.
+ */
+#define SBRK_ZEROED 0
+
+/*
+ * Heap growth. An arena's heap is extended by at least chunksize bytes;
+ * each extension doubles the step of the next, up to heap_grow_max and to
+ * a heap_grow_ratio-th of the heap, so that a heap growing to gigabytes
+ * takes a few hundred extensions rather than hundreds of thousands while
+ * a small one keeps little slack. Trimming an arena starts over with
+ * chunksize. The memory is already reserved (by mem_sbrk's heap, or the
+ * arena's reservation) and is only committed by the break moving up.
+ */
+static const size_t heap_grow_ratio = 8;
+
+/*
+ * Transparent huge pages. With MM_OPT_HUGE_PAGES set, growth steps of at
+ * least huge_page_size end on a huge_page_size boundary, the whole huge
+ * pages of new heap memory and of mapped blocks are advised MADV_HUGEPAGE,
+ * and purging and trimming give back only whole huge pages, so that the
+ * kernel does not have to split them for a few free small pages.
+ */
+static const size_t huge_page_size = (size_t)2 << 20;
+
+/*
+ * Decay. Dirty blocks of at least a page keep the time they were last
+ * dirtied (in ms) in their third payload word. Without the background
+ * thread an arena checks for expired blocks every decay_ticks heap
+ * allocations.
+ */
+static const unsigned int decay_ticks = 256;
+static const long background_wakeups = 8;//Per decay period
+
+/*
+ * Slabs: size classes of 16, 32, ..., slab_max_size bytes. Each slab is
+ * slab_size bytes, aligned to slab_size, with a slab_t header followed by
+ * its objects. Objects have no header or footer, so payloads of up to 16
+ * bytes take 16 bytes, half the min_block_size a heap block needs for its
+ * header, two links and footer; the heap lists can keep full pointers.
+ */
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE >> ALIGNMENT_LOG2)
+static const size_t slab_max_size = SLAB_MAX_SIZE;
+static const size_t slab_size = (1 << 12);
+static const size_t slab_reserve = (size_t)1 << 36;
+
+/*
+ * Thread cache: one LIFO list per 16 byte class of adjusted block sizes up
+ * to tcache_max_size, followed by one per slab class. A miss refills
+ * tcache_fill_count objects under a single lock acquisition; a full bin
+ * flushes its older half back to the arenas.
+ */
+#define TCACHE_MAX_SIZE 1024
+#define TCACHE_HEAP_BINS ((TCACHE_MAX_SIZE >> ALIGNMENT_LOG2) + 1)
+#define TCACHE_BINS (TCACHE_HEAP_BINS + SLAB_CLASSES)
+static const size_t tcache_max_size = TCACHE_MAX_SIZE;
+static const unsigned int tcache_count_max = 32;
+static const unsigned int tcache_fill_count = 8;
+
+/*
+ * Fast bins: heap blocks of up to fastbin_max_size bytes freed into an
+ * arena, by thread cache flushes and remote frees, go on a LIFO list per
+ * 16 byte class without being coalesced; they stay allocated in the heap
+ * so their neighbours do not merge with them either. The arena coalesces
+ * them all at once when a request finds no fit, or once they hold more
+ * than fastbin_consolidate_bytes.
+ */
+#define FASTBIN_COUNT TCACHE_HEAP_BINS
+static const size_t fastbin_max_size = TCACHE_MAX_SIZE;
+static const size_t fastbin_consolidate_bytes = (size_t)64 << 10;
+
+/*
+ * Regions: chunks of region_chunk_size bytes (unless the region asked for
+ * others) allocated from the heap, objects bump allocated inside them with
+ * no header. An object larger than a quarter of a chunk gets a chunk of
+ * its own, freed when the region is reset.
+ */
+static const size_t region_chunk_size = (size_t)64 << 10;
+static const size_t region_chunk_min = (1 << 12);
+
+/*
+ * Heap profiling. With a sampling interval set, each thread counts down
+ * the bytes it allocates and samples the allocation that crosses zero, the
+ * intervals being exponentially distributed around prof_sample_bytes. A
+ * sampled allocation always gets a heap or mapped block of its own, never
+ * a slab object or a cached block, so its header can carry the sampled
+ * bit that free checks. The backtraces of live samples are kept in a hash
+ * table by address, with counts per distinct stack in another.
+ */
+#define PROF_MAX_FRAMES 24
+#define PROF_STACKS 4096
+#define PROF_SAMPLES (1 << 16)
+static const size_t prof_sample_max = (size_t)1 << 40;
+
+/*
+ * Latency histograms. Set LATENCY_HIST to time malloc, free, realloc and
+ * calloc, and the find_fit, coalesce and extend_heap phases inside them,
+ * with the cycle counter (the time stamp counter on x86, the virtual
+ * counter on ARM, nanoseconds elsewhere). Each thread counts the calls of
+ * every op in buckets by the log2 of the cycles they took; mm_latency
+ * sums the threads. LATENCY_SCOPE times the rest of the enclosing function.
+ * Off unless the build defines it, e.g. with -DLATENCY_HIST=1.
+ */
+#ifndef LATENCY_HIST
+#define LATENCY_HIST 0
+#endif
+
+#if LATENCY_HIST
+#define LATENCY_SCOPE(op) \
+    latency_scope_t latency_scope __attribute__((cleanup(latency_end))) = { latency_now(), op }
+#else
+#define LATENCY_SCOPE(op)
+#endif
+
+/*
+ * Arenas. Every arena other than the main one lives at the start of its own
+ * arena_reserve byte mapping, aligned to arena_reserve, so masking a block
+ * address gives its arena_t. ARENA_BY_CPU picks the arena from the CPU the
+ * thread runs on at each heap access instead of a fixed round-robin slot.
+ */
+#define ARENA_MAX 64
+#define ARENA_BY_CPU 0
+static const size_t arena_reserve = (size_t)1 << 36;
+
 typedef struct block
 {
     /* Header contains size + allocation flag */
@@ -78,22 +336,191 @@ typedef struct block
     
 } block_t;
 
+typedef struct slab
+{
+    struct arena *arena;//Arena the slab belongs to
+    struct slab *next;//Links of the arena's list of slabs with free objects
+    struct slab *prev;
+    void *free;//Freed objects, linked through their first word
+    char *bump;//Objects from here to the end have never been handed out
+    uint32_t size;//Object size
+    uint32_t used;//Objects currently handed out
+    uint32_t capacity;
+    int cls;
+} slab_t;
+
+typedef struct fit_index
+{
+    size_t *sizes;//sizes[i] is the size of blocks[i]
+    struct block **blocks;
+    uint32_t count;
+    uint32_t capacity;
+    bool lost;//An array could not grow, some blocks are not in it
+} fit_index_t;
+
+typedef struct arena
+{
+    pthread_mutex_t lock;//Protects everything below
+    block_t *heap_listp;//Pointer to first block
+    block_t *prologue;
+    block_t *epilogue;
+    block_t *free_list[NUM_LISTS];//For holding the heads of all the segregated lists.
+    block_t *tail[NUM_LISTS];//For Holding the tails of all the segregated lists.
+    uint64_t fl_bitmap;//Bit f is set if any list of first level f is non empty
+    uint32_t sl_bitmap[FL_INDEX_COUNT];//Bit s of entry f is set if list (f,s) is non empty
+    int free_blocks;
+    fit_index_t fit_index[NUM_LISTS];//Mirrors of the range lists below tree_index
+    block_t *fastbins[FASTBIN_COUNT];//Uncoalesced small blocks, linked through their first word
+    size_t fast_bytes;//Bytes in fastbins
+    block_t *tree_root;//Large free blocks under a best fit policy
+    int tree_index;//Lists from this one on are kept in the tree, NUM_LISTS if none
+    int fit_policy;//MM_FIT_ policy the arena was initialized with
+    uint64_t nextend;//extend_heap calls
+    uint64_t nsplit;//Blocks split by place
+    uint64_t ncoalesce[4];//coalesce calls per case
+    unsigned int decay_ticks;//Heap allocations since the last decay check
+    size_t grow;//Step of the next extend_heap, see heap_grow_size
+    slab_t *slabs[SLAB_CLASSES];//Slabs with free objects, per class
+    /*
+     * Objects freed by threads that allocate from other arenas, linked
+     * through their first word. Pushed without the lock, drained under it.
+     */
+    void *remote_free;
+    int threads;//Threads given this arena round-robin; accessed atomically
+    char *brk;//Top of the heap of a non main arena
+    char *end;//End of its reservation
+} arena_t;
+
+typedef struct thread_stats
+{
+    /* Written by the owning thread only, read by mm_stats */
+    uint64_t nmalloc;
+    uint64_t nfree;
+    size_t allocated;//Usable bytes handed out
+    size_t freed;//Usable bytes given back, possibly allocated by other threads
+#if LATENCY_HIST
+    uint64_t latency[MM_LAT_OPS][MM_LAT_BUCKETS];//Calls per op and log2 of cycles, read by mm_latency
+#endif
+} thread_stats_t;
+
+typedef struct latency_scope
+{
+    uint64_t start;//Cycle counter when the scope was entered
+    int op;//MM_LAT_ op the scope is counted as
+} latency_scope_t;
+
+typedef struct tcache
+{
+    /* Cached payloads are linked through their first word */
+    void *bins[TCACHE_BINS];
+    unsigned int counts[TCACHE_BINS];
+    /* Arena the thread allocates from, NULL until its first heap access */
+    arena_t *arena;
+    /* heap_generation the cached blocks and arena belong to */
+    unsigned long generation;
+    bool registered;
+    thread_stats_t stats;
+    /* Bytes left to allocate before the next sample, and its generator */
+    int64_t prof_left;
+    uint64_t prof_seed;
+    bool prof_busy;//Taking a backtrace, which may allocate
+    /* Links of the registered caches, protected by stats_lock */
+    struct tcache *next;
+    struct tcache *prev;
+} tcache_t;
+
+typedef struct region_chunk
+{
+    struct region_chunk *next;
+    size_t size;//Bytes of the chunk, including this header
+    char data[0];
+} region_chunk_t;
+
+struct mm_region
+{
+    region_chunk_t *chunks;//Chunks of chunk_size bytes, in the order they fill
+    region_chunk_t *current;//Chunk being bump allocated, NULL before the first
+    region_chunk_t *large;//Chunks of a single large object each
+    char *bump;//Next free byte of current
+    char *limit;//End of current
+    size_t chunk_size;
+};
+
+typedef struct prof_stack
+{
+    uint64_t hash;//0 for an unused entry
+    uint64_t inuse_count;//Sampled objects still allocated
+    uint64_t inuse_bytes;
+    uint64_t alloc_count;//Sampled objects ever allocated
+    uint64_t alloc_bytes;
+    int depth;
+    void *frames[PROF_MAX_FRAMES];
+} prof_stack_t;
+
+typedef struct prof_sample
+{
+    void *bp;//NULL for an unused entry
+    size_t size;//Bytes requested
+    prof_stack_t *stack;
+} prof_sample_t;
+
+typedef struct prof_out
+{
+    int fd;
+    bool ok;//No write failed
+    size_t len;
+    char buf[4096];//Formatted output not written yet
+} prof_out_t;
 
 /* Global variables */
-/* Pointer to first block */
-static block_t *heap_listp = NULL;
-static block_t *free_list[5];//For holding the heads of all the segregated lists.
-static block_t *tail[5];//For Holding the tails of all the segregated lists.
-static int free_blocks=0;
-static block_t *epilogue=NULL;
-static block_t *prologue=NULL;
+static arena_t main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static arena_t *arenas[ARENA_MAX];//arenas[0] is the main arena, others created on demand
+static int arena_limit=1;//Number of arenas threads are spread over
+static unsigned int next_arena=0;//Round-robin counter for thread assignment
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;//Protects arenas[]
+static unsigned long heap_generation=0;//Bumped by mm_init, invalidates thread caches
+static char *slab_base=NULL;//Slab region, reserved once
+static char *slab_end=NULL;
+static char *slab_brk=NULL;//Slabs below this have been carved
+static slab_t *slab_free_pages=NULL;//Empty slabs available to any arena
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;//Protects the three above
+static size_t mmap_threshold = (size_t)128 << 10;//Accessed atomically
+static bool mmap_threshold_dynamic = true;
+static size_t trim_threshold = (size_t)128 << 10;//Accessed atomically
+static size_t purge_threshold = (size_t)256 << 10;//Accessed atomically
+static size_t heap_grow_max = (size_t)8 << 20;//Accessed atomically
+static bool heap_prefault = false;//Back new heap and mapped memory at once; accessed atomically
+static bool heap_huge_pages = false;//Lay out memory for transparent huge pages; accessed atomically
+static int fit_policy = MM_FIT_FIRST;//Applied by arena_init; accessed atomically
+static long dirty_decay_ms = 0;//0 releases memory when freed; accessed atomically
+static bool background_enabled = false;//Protected by background_lock
+static bool background_running = false;
+static pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t background_cond = PTHREAD_COND_INITIALIZER;
+static size_t mmap_bytes=0;//Bytes of mapped blocks; accessed atomically
+static tcache_t *stats_threads=NULL;//Caches of live threads, for their counters
+static thread_stats_t stats_retired;//Counters of exited threads
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;//Protects the two above
+static size_t prof_sample_bytes = 0;//Mean sampling interval, 0 if off; accessed atomically
+static prof_stack_t *prof_stacks = NULL;//Tables of the profiler, mapped on first use
+static prof_sample_t *prof_samples = NULL;
+static size_t prof_nstacks = 0;
+static size_t prof_nsamples = 0;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;//Protects the four above
+static const char *latency_names[MM_LAT_OPS] =
+    { "malloc", "free", "realloc", "calloc", "find_fit", "coalesce", "extend_heap" };
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;//Flushes the cache of an exiting thread
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
 
 /* Function prototypes for internal helper routines */
-static block_t *extend_heap(size_t size);
-static void place(block_t *block, size_t asize);
-static block_t *find_fit(size_t asize,int index);
-static block_t *coalesce(block_t *block);
+static block_t *extend_heap(arena_t *a, size_t size);
+static void place(arena_t *a, block_t *block, size_t asize);
+static block_t *find_fit(arena_t *a, size_t asize,int index);
+static block_t *coalesce(arena_t *a, block_t *block);
 static size_t max(size_t x, size_t y);
+static size_t min(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
 static word_t pack(size_t size, bool alloc);
 static size_t extract_size(word_t header);
@@ -109,15 +536,132 @@ static bool is_previous_allocated(block_t*block_t);
 static block_t *payload_to_header(void *bp);
 static void *header_to_payload(block_t *block);
 static int get_index(size_t size);
+static int find_nonempty_list(arena_t *a, int index);
+static int fls_size(size_t size);
 static block_t *find_next(block_t *block);
 static word_t *find_prev_footer(block_t *block);
 static block_t *find_prev(block_t *block);
-static void enqueue(block_t * block,int index);
-static void dequeue(block_t * block,int index);
+static void enqueue(arena_t *a, block_t * block,int index);
+static void dequeue(arena_t *a, block_t * block,int index);
+static void tree_insert(arena_t *a, block_t *block);
+static void tree_remove(arena_t *a, block_t *block);
+static block_t *tree_find(arena_t *a, size_t asize, bool lowest);
+static bool fit_indexed(arena_t *a, int index);
+static void fit_index_add(arena_t *a, block_t *block, int index);
+static void fit_index_remove(arena_t *a, block_t *block, int index);
+static block_t *fit_index_find(fit_index_t *fit, size_t asize);
+static bool fit_index_grow(fit_index_t *fit);
+static void fit_index_release(arena_t *a);
+static block_t *tree_next(block_t *block);
+static void tree_rotate(arena_t *a, block_t *block, int dir);
+static void tree_replace(arena_t *a, block_t *old, block_t *block, block_t *parent);
+static block_t **tree_child(block_t *block, int dir);
+static block_t *tree_parent(block_t *block);
+static void tree_set_parent(block_t *block, block_t *parent);
+static bool tree_is_red(block_t *block);
+static void tree_set_red(block_t *block, bool red);
+static bool tree_less(block_t *x, block_t *y);
+static int check_tree(arena_t *a, block_t *block, block_t *parent, int *count);
+static bool arena_init(arena_t *a, word_t *start);
+static arena_t *arena_create(void);
+static arena_t *arena_of(block_t *block);
+static arena_t *thread_arena(void);
+static void *arena_sbrk(arena_t *a, size_t size);
+static bool arena_contains(arena_t *a, void *p);
+static bool check_arena(arena_t *a, int lineno);
+static void *allocate(size_t size, bool clear);
+static void *allocate_aligned(size_t alignment, size_t size);
+static void heap_init_once(void);
+static void clear_payload(void *bp, size_t size, bool zeroed);
+static void *arena_malloc(int bin, size_t asize, bool *zeroed);
+static void *bin_malloc(arena_t *a, int bin, size_t asize);
+static void arena_free(arena_t *a, void *bp);
+static void remote_push(arena_t *a, void *first, void *last);
+static void arena_drain(arena_t *a);
+static void fastbin_put(arena_t *a, block_t *block);
+static void arena_consolidate(arena_t *a);
+static arena_t *owner_arena(void *bp);
+static void *heap_malloc(arena_t *a, size_t asize, bool *zeroed);
+static void *heap_memalign(arena_t *a, size_t alignment, size_t asize);
+static size_t heap_malloc_batch(arena_t *a, size_t asize, size_t n, void **ptrs);
+static size_t place_run(arena_t *a, block_t *block, size_t asize, size_t count, void **ptrs);
+static void sort_addresses(void **ptrs, size_t n);
+static void sift_down(void **ptrs, size_t root, size_t end);
+static void *region_refill(mm_region_t *region, size_t size);
+static bool prof_tick(size_t size);
+static int64_t prof_interval(void);
+static double prof_log(double x);
+static void prof_record(void *bp, size_t size);
+static void prof_free(void *bp);
+static prof_stack_t *prof_stack_find(void **frames, int depth);
+static size_t prof_slot(void *bp);
+static bool is_sampled(block_t *block);
+static void prof_write(prof_out_t *out, const char *fmt, ...);
+static void prof_flush(prof_out_t *out);
+static size_t align_gap(block_t *block, size_t alignment);
+static void heap_free(arena_t *a, block_t *block);
+static bool heap_resize(arena_t *a, block_t *block, size_t asize);
+static void heap_trim(arena_t *a, block_t *block, size_t asize);
+static void heap_release(arena_t *a, block_t *block, block_t *dirty);
+static size_t release_size(arena_t *a, block_t *block);
+static void release_block(arena_t *a, block_t *block, block_t *dirty);
+static void arena_decay(arena_t *a, uint64_t now, bool force);
+static void decay_block(arena_t *a, block_t *block, uint64_t now, bool force);
+static void decay_all(bool force);
+static void *background_thread(void *arg);
+static bool background_thread_enable(bool enable);
+static uint64_t now_ms(void);
+static void arena_trim(arena_t *a, block_t *block);
+static void purge_pages(void *lo, void *hi);
+static void prefault_pages(void *lo, size_t size);
+static void advise_huge_pages(void *lo, void *hi);
+static size_t purge_page_size(void);
+static size_t heap_grow_size(arena_t *a, size_t want);
+static bool is_purged(block_t *block);
+static void set_purged(block_t *block, bool purged);
+static bool is_zeroed(block_t *block);
+static void set_zeroed(block_t *block, bool zeroed);
+static size_t usable_size(void *bp);
+static size_t cached_size(void *bp, int bin);
+static bool is_mmapped(block_t *block);
+static void *mmap_malloc(size_t size, size_t alignment);
+static char *mmap_start(block_t *block);
+static void mmap_free(block_t *block);
+static void *mmap_realloc(block_t *block, size_t size);
+static bool is_slab(void *bp);
+static slab_t *slab_of(void *bp);
+static int slab_class(size_t size);
+static void *slab_malloc(arena_t *a, int cls);
+static void slab_free(arena_t *a, void *bp);
+static slab_t *slab_create(arena_t *a, int cls);
+static void slab_unlink(arena_t *a, slab_t *slab);
+static void slab_release(slab_t *slab);
+static void *tcache_get(int bin);
+static void *tcache_fill(arena_t *a, int bin, size_t asize);
+static void tcache_put(void *bp, int bin);
+static void tcache_flush(void *bp);
+static void tcache_check_generation(void);
+static void tcache_register(void);
+static void tcache_create_key(void);
+static void tcache_thread_exit(void *arg);
+static void stats_count(size_t allocated, size_t freed, uint64_t nmalloc, uint64_t nfree);
+static void stats_sum(mm_stats_t *stats, thread_stats_t *counts);
+static void arena_stats(arena_t *a, mm_stats_t *stats);
+static void stats_block(mm_stats_t *stats, block_t *block);
+static uint64_t latency_quantile(const uint64_t *buckets, uint64_t total, double q);
+#if LATENCY_HIST
+static uint64_t latency_now(void);
+static void latency_end(latency_scope_t *scope);
+static void latency_sum(mm_latency_t *latency, thread_stats_t *counts);
+#endif
 bool mm_checkheap(int lineno);
 static void print_list(void);
 /*
  * mm_init: initializes the heap; it is run once when heap_start == NULL.
+ *          It must not race with other allocator calls, including the
+ *          background thread, which must be disabled; re-initializing
+ *          unmaps the other arenas and bumps heap_generation so that stale
+ *          thread caches and arena assignments are dropped.
  *          prior to any extend_heap operation, this is the heap:
  *              start            start+8           start+16
  *          INIT: | PROLOGUE_FOOTER | EPILOGUE_HEADER |
@@ -125,6 +669,58 @@ static void print_list(void);
  */
 bool mm_init(void) 
 {   
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    fit_index_release(&main_arena);
+    for (int i = 1; i < ARENA_MAX; i++)
+    {
+        if (arenas[i] != NULL)
+        {
+            fit_index_release(arenas[i]);
+            munmap(arenas[i], arena_reserve);
+            arenas[i] = NULL;
+        }
+    }
+    arenas[0] = &main_arena;
+    if (slab_base == NULL)
+    {
+        char *map = mmap(NULL, slab_reserve, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map != MAP_FAILED)
+        {
+            slab_base = map;
+            slab_end = map + slab_reserve;
+        }
+    }
+    else
+    {
+        madvise(slab_base, slab_brk - slab_base, MADV_DONTNEED);
+    }
+    slab_brk = slab_base;
+    slab_free_pages = NULL;
+    arena_limit = (cpus > 0) ? (int)(2 * cpus) : 1;
+    if (arena_limit > ARENA_MAX)
+    {
+        arena_limit = ARENA_MAX;
+    }
+    heap_generation++;
+    pthread_mutex_lock(&stats_lock);
+    for (tcache_t *cache = stats_threads; cache != NULL; cache = cache->next)
+    {
+        memset(&cache->stats, 0, sizeof(cache->stats));
+    }
+    memset(&stats_retired, 0, sizeof(stats_retired));
+    pthread_mutex_unlock(&stats_lock);
+    __atomic_store_n(&mmap_bytes, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&prof_lock);
+    if (prof_stacks != NULL)
+    {
+        memset(prof_samples, 0, PROF_SAMPLES * sizeof(prof_sample_t));
+        memset(prof_stacks, 0, PROF_STACKS * sizeof(prof_stack_t));
+    }
+    prof_nsamples = 0;
+    prof_nstacks = 0;
+    pthread_mutex_unlock(&prof_lock);
 
     // Create the initial empty heap 
     word_t *start = (word_t *)(mem_sbrk(2*wsize));
@@ -133,405 +729,3978 @@ bool mm_init(void)
     {
         return false;
     }
-    prologue=(block_t *) start;
-    start[0] = pack(0, true); // Prologue footer
-    start[1] = pack(0, true); // Epilogue header
-    // Heap starts with first block header (epilogue)
-    heap_listp = (block_t *) &(start[1]);
-    epilogue=heap_listp;
-    set_previous_allocated(epilogue);
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL)
-    {
-        return false;
-    }
-    free_list[get_index(chunksize)]=heap_listp;
-    tail[get_index(chunksize)]=heap_listp;
-    ((word_t *)heap_listp->payload)[0]=0;
-    ((word_t *)heap_listp->payload)[1]=0;
-    free_blocks++;
-    return true;
+    return arena_init(&main_arena, start);
 }
 
 /*
  * malloc: allocates a block with size at least (size + dsize), rounded up to
- *         the nearest 16 bytes, with a minimum of 2*dsize. Seeks a
- *         sufficiently-large unallocated block on the heap to be allocated.
- *         If no such block is found, extends heap by the maximum between
- *         chunksize and (size + dsize) rounded up to the nearest 16 bytes,
- *         and then attempts to allocate all, or a part of, that memory.
+ *         the nearest 16 bytes, with a minimum of 2*dsize. Small requests are
+ *         served from the thread cache when it has a block of that class,
+ *         otherwise the thread's arena is searched under its lock (see
+ *         heap_malloc).
  *         Returns NULL on failure, otherwise returns a pointer to such block.
  *         The allocated block will not be used for further allocations until
  *         freed.
  */
 void *malloc(size_t size) 
 {
-    dbg_requires(mm_checkheap(__LINE__));    
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
+    LATENCY_SCOPE(MM_LAT_MALLOC);
+    return allocate(size, false);
+}
+
+/*
+ * allocate: the body of malloc and calloc; with clear set the payload is
+ *           zeroed, skipping memory known to be zero already (see
+ *           clear_payload). Mapped blocks are fresh pages and need nothing.
+ */
+static void *allocate(size_t size, bool clear)
+{
+    size_t asize = 0;  // Adjusted block size
+    int bin = -1;      // Thread cache bin, -1 if the size is not cached
     void *bp = NULL;
+    bool zeroed = false; // The heap block was still zero from the OS
+    bool sample;       // Sampled by the heap profiler, see prof_tick
 
-    if (heap_listp == NULL) // Initialize heap if it isn't initialized
+    if (size == 0) // Ignore spurious request
     {
-        mm_init();
+        return bp;
     }
 
-    if (size == 0) // Ignore spurious request
+    sample = prof_tick(size);
+    if (size <= slab_max_size && slab_base != NULL && !sample)
+    {
+        bin = TCACHE_HEAP_BINS + slab_class(size);
+    }
+    else if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
     {
-        dbg_ensures(mm_checkheap(__LINE__));
+        bp = mmap_malloc(size, ALIGNMENT);
+        if (bp != NULL)
+        {
+            stats_count(usable_size(bp), 0, 1, 0);
+            if (sample)
+            {
+                prof_record(bp, size);
+            }
+        }
+        dbg_printf("Malloc size %zd on address %p.\n", size, bp);
         return bp;
     }
+    else
+    {
+        // Adjust block size to include overhead and to meet alignment requirements
+        asize = max(round_up(size+wsize,dsize), min_block_size);
+        if (asize <= tcache_max_size && !sample)
+        {
+            bin = asize >> ALIGNMENT_LOG2;
+        }
+    }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size+wsize,dsize);
-    if(asize<min_block_size)
-        asize=min_block_size;
-
-    // Search the free list for a fit
-    int index=get_index(asize);
-    block = find_fit(asize,index);
-
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL)
-    {   
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        if (block == NULL) // extend_heap returns an error
+    if (bin >= 0)
+    {
+        bp = tcache_get(bin);
+        if (bp != NULL)
         {
+            if (clear)
+            {
+                memset(bp, 0, size);
+            }
+            stats_count(cached_size(bp, bin), 0, 1, 0);
             return bp;
         }
     }
-    place(block, asize);
-    bp = header_to_payload(block);
+
+    heap_init_once();
+    bp = arena_malloc(bin, asize, &zeroed);
+    if (bp == NULL && bin >= TCACHE_HEAP_BINS)
+    {
+        // The slab region is exhausted, use a heap block instead
+        asize = max(round_up(size+wsize,dsize), min_block_size);
+        bp = arena_malloc(-1, asize, &zeroed);
+    }
+    if (bp != NULL)
+    {
+        if (clear)
+        {
+            clear_payload(bp, size, zeroed);
+        }
+        stats_count(usable_size(bp), 0, 1, 0);
+        if (sample)
+        {
+            prof_record(bp, size);
+        }
+    }
     dbg_printf("Malloc size %zd on address %p.\n", size, bp);
-    dbg_ensures(mm_checkheap(__LINE__));
-    
 
    return bp;
 } 
 
 /*
- * free: Frees the block such that it is no longer allocated while still
- *       maintaining its size. Block will be available for use on malloc.
+ * allocate_aligned: the body of the aligned allocation functions: returns
+ *                   a block of size bytes whose payload is a multiple of
+ *                   alignment, a power of two. Mapped blocks start their
+ *                   payload at the aligned offset into the mapping; heap
+ *                   blocks are carved at an aligned address out of a free
+ *                   block, the slack on both sides going back to the
+ *                   segregated lists (see heap_memalign). Returns NULL on
+ *                   failure.
  */
-void free(void *bp)
+static void *allocate_aligned(size_t alignment, size_t size)
 {
-   if (bp == NULL)
+    size_t asize;
+    void *bp = NULL;
+
+    if (alignment <= ALIGNMENT)
     {
-        return;
+        return allocate(size, false);
+    }
+    if (size == 0 || size > SIZE_MAX - alignment - min_block_size - dsize)
+    {
+        return NULL;
     }
 
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
-    write_header(block, size, false);
-    write_footer(block, size, false);
-    coalesce(block);
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+    {
+        bp = mmap_malloc(size, alignment);
+    }
+    else
+    {
+        asize = max(round_up(size+wsize,dsize), min_block_size);
+        heap_init_once();
+        arena_t *a = thread_arena();
+        while (true)
+        {
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            bp = heap_memalign(a, alignment, asize);
+            pthread_mutex_unlock(&a->lock);
+            if (bp != NULL || a == &main_arena)
+            {
+                break;
+            }
+            a = &main_arena;
+        }
+    }
+    if (bp != NULL)
+    {
+        stats_count(usable_size(bp), 0, 1, 0);
+        if (prof_tick(size))
+        {
+            prof_record(bp, size);
+        }
+    }
+    dbg_printf("Memalign size %zd alignment %zd on address %p.\n", size, alignment, bp);
+    return bp;
+}
 
+/*
+ * heap_init_once: initializes the heap on the first heap allocation.
+ */
+static void heap_init_once(void)
+{
+    if (__atomic_load_n(&main_arena.heap_listp, __ATOMIC_ACQUIRE) == NULL)
+    {
+        pthread_mutex_lock(&main_arena.lock);
+        if (main_arena.heap_listp == NULL)
+        {
+            mm_init();
+        }
+        pthread_mutex_unlock(&main_arena.lock);
+    }
 }
 
 /*
- * realloc: returns a pointer to an allocated region of at least size bytes:
- *          if ptrv is NULL, then call malloc(size);
- *          if size == 0, then call free(ptr) and returns NULL;
- *          else allocates new region of memory, copies old data to new memory,
- *          and then free old block. Returns old block if realloc fails or
- *          returns new pointer on success.
+ * free: Frees the block such that it is no longer allocated while still
+ *       maintaining its size. Slab objects and small blocks go to the
+ *       thread cache, the blocks staying allocated in the heap; mapped
+ *       blocks are unmapped; others are freed and coalesced into the arena
+ *       owning them, or queued for it (see remote_push) if the calling
+ *       thread allocates from another arena. Block will be available for
+ *       use on malloc.
  */
-void *realloc(void *ptr, size_t size)
+void free(void *bp)
 {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
+    LATENCY_SCOPE(MM_LAT_FREE);
+   if (bp == NULL)
+    {
+        return;
+    }
 
-    // If size == 0, then free block and return NULL
-    if (size == 0)
+    if (is_slab(bp))
     {
-        free(ptr);
-        return NULL;
+        int bin = TCACHE_HEAP_BINS + slab_of(bp)->cls;
+        stats_count(0, cached_size(bp, bin), 0, 1);
+        tcache_put(bp, bin);
+        return;
     }
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL)
+    block_t *block = payload_to_header(bp);
+    if (is_sampled(block))
     {
-        return malloc(size);
+        prof_free(bp);
+    }
+    if (is_mmapped(block))
+    {
+        stats_count(0, usable_size(bp), 0, 1);
+        mmap_free(block);
+        return;
+    }
+    size_t size = get_size(block);
+    stats_count(0, size - wsize, 0, 1);
+    if (size <= tcache_max_size)
+    {
+        tcache_put(bp, size >> ALIGNMENT_LOG2);
+        return;
     }
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
-    // If malloc fails, the original block is left untouched
-    if (!newptr)
+    arena_t *a = arena_of(block);
+    if (a != tcache.arena)
     {
-        return NULL;
+        remote_push(a, bp, bp);
+        return;
     }
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    heap_free(a, block);
+    pthread_mutex_unlock(&a->lock);
+}
 
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if(size < copysize)
+/*
+ * free_sized: frees bp, allocated or last reallocated with size bytes. A
+ *             slab object's class follows from size, so it goes to the
+ *             thread cache without its slab header being read; anything
+ *             else is freed as by free, its header being next to bp.
+ */
+void free_sized(void *bp, size_t size)
+{
+    if (bp != NULL && size <= slab_max_size && is_slab(bp))
     {
-        copysize = size;
+        int bin = TCACHE_HEAP_BINS + slab_class(size);
+        dbg_assert(bin - TCACHE_HEAP_BINS == slab_of(bp)->cls);
+        stats_count(0, cached_size(bp, bin), 0, 1);
+        tcache_put(bp, bin);
+        return;
     }
-    memcpy(newptr, ptr, copysize);
+    free(bp);
+}
 
-    // Free the old block
-    free(ptr);
+/*
+ * free_aligned_sized: frees bp, allocated with alignment and size bytes.
+ *                     Aligned blocks are never slab objects, so only an
+ *                     alignment malloc gives anyway can use the size.
+ */
+void free_aligned_sized(void *bp, size_t alignment, size_t size)
+{
+    if (alignment <= ALIGNMENT)
+    {
+        free_sized(bp, size);
+        return;
+    }
+    free(bp);
+}
 
-    return newptr;
+/*
+ * malloc_usable_size: returns the number of bytes usable at bp, at least
+ *                     the size it was allocated with: the payload of its
+ *                     block (see get_payload_size) or its slab object.
+ *                     Returns 0 for NULL.
+ */
+size_t malloc_usable_size(void *bp)
+{
+    if (bp == NULL)
+    {
+        return 0;
+    }
+    return usable_size(bp);
 }
 
 /*
- * calloc: Allocates a block with size at least (elements * size + dsize)
- *         through malloc, then initializes all bits in allocated memory to 0.
- *         Returns NULL on failure.
+ * mm_malloc_batch: allocates up to n blocks of size bytes into ptrs and
+ *                  returns how many it got, fewer than n only on failure.
+ *                  Cached blocks are taken first; the rest of a heap batch
+ *                  is carved out of as few free blocks as possible, in a
+ *                  single pass over each (see heap_malloc_batch), and a
+ *                  slab batch is taken under a single lock acquisition.
  */
-void *calloc(size_t nmemb, size_t size)
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs)
 {
-    void *bp;
-    size_t asize = nmemb * size;
+    size_t asize = 0;
+    size_t got = 0;
+    size_t bytes = 0;
+    int bin = -1;
 
-    if (asize/nmemb != size)
-    // Multiplication overflowed
-    return NULL;
-    
-    bp = malloc(asize);
-    if (bp == NULL)
+    if (size == 0 || n == 0)
     {
-        return NULL;
+        return 0;
+    }
+    if (size <= slab_max_size && slab_base != NULL)
+    {
+        bin = TCACHE_HEAP_BINS + slab_class(size);
+    }
+    else if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+    {
+        while (got < n && (ptrs[got] = malloc(size)) != NULL)
+        {
+            got++;
+        }
+        return got;
+    }
+    else
+    {
+        asize = max(round_up(size+wsize,dsize), min_block_size);
+        if (asize <= tcache_max_size)
+        {
+            bin = asize >> ALIGNMENT_LOG2;
+        }
+    }
+
+    while (bin >= 0 && got < n && (ptrs[got] = tcache_get(bin)) != NULL)
+    {
+        bytes += cached_size(ptrs[got], bin);
+        got++;
+    }
+    if (got < n)
+    {
+        heap_init_once();
+        arena_t *a = thread_arena();
+        while (true)
+        {
+            size_t start = got;
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            if (bin >= TCACHE_HEAP_BINS)
+            {
+                while (got < n
+                       && (ptrs[got] = slab_malloc(a, bin - TCACHE_HEAP_BINS)) != NULL)
+                {
+                    got++;
+                }
+            }
+            else
+            {
+                got += heap_malloc_batch(a, asize, n - got, ptrs + got);
+            }
+            pthread_mutex_unlock(&a->lock);
+            for (size_t i = start; i < got; i++)
+            {
+                bytes += (bin >= 0) ? cached_size(ptrs[i], bin) : usable_size(ptrs[i]);
+            }
+            if (got == n || a == &main_arena)
+            {
+                break;
+            }
+            a = &main_arena;
+        }
+    }
+    stats_count(bytes, 0, got, 0);
+    // The slab region is exhausted, use heap blocks instead
+    while (got < n && bin >= TCACHE_HEAP_BINS && (ptrs[got] = malloc(size)) != NULL)
+    {
+        got++;
+    }
+    return got;
+}
+
+/*
+ * mm_free_batch: frees the n blocks in ptrs, which it sorts by address;
+ *                NULL entries are skipped. Each arena's lock is taken once
+ *                per run of its blocks, and a run of blocks adjacent in
+ *                the heap is merged and coalesced with a single heap_free.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    arena_t *locked = NULL;
+    size_t bytes = 0;
+    uint64_t count = 0;
+
+    sort_addresses(ptrs, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        void *bp = ptrs[i];
+        block_t *block;
+        arena_t *a;
+
+        if (bp == NULL)
+        {
+            continue;
+        }
+        count++;
+        block = payload_to_header(bp);
+        if (!is_slab(bp) && is_sampled(block))
+        {
+            prof_free(bp);
+        }
+        if (!is_slab(bp) && is_mmapped(block))
+        {
+            bytes += usable_size(bp);
+            mmap_free(block);
+            continue;
+        }
+        a = owner_arena(bp);
+        if (a != locked)
+        {
+            if (locked != NULL)
+            {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            locked = a;
+        }
+        if (is_slab(bp))
+        {
+            bytes += slab_of(bp)->size;
+            slab_free(a, bp);
+            continue;
+        }
+
+        // Take in the blocks that follow this one in the heap
+        size_t size = get_size(block);
+        size_t run = size;
+        bytes += size - wsize;
+        while (i + 1 < n && ptrs[i + 1] == (char *)bp + run)
+        {
+            block_t *next = payload_to_header(ptrs[++i]);
+            if (is_sampled(next))
+            {
+                prof_free(ptrs[i]);
+            }
+            size = get_size(next);
+            run += size;
+            bytes += size - wsize;
+            count++;
+        }
+        if (run == get_size(block))
+        {
+            arena_free(a, bp);
+        }
+        else
+        {
+            write_header(block, run, true);
+            heap_free(a, block);
+        }
+    }
+    if (locked != NULL)
+    {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    stats_count(0, bytes, 0, count);
+}
+
+/*
+ * mm_region_create: returns an empty region whose chunks are chunk_size
+ *                   bytes (region_chunk_size if 0, at least
+ *                   region_chunk_min), or NULL if out of memory. The
+ *                   first chunk is allocated on the first mm_region_alloc.
+ */
+mm_region_t *mm_region_create(size_t chunk_size)
+{
+    mm_region_t *region = malloc(sizeof(mm_region_t));
+
+    if (region == NULL)
+    {
+        return NULL;
+    }
+    if (chunk_size == 0)
+    {
+        chunk_size = region_chunk_size;
+    }
+    region->chunks = NULL;
+    region->current = NULL;
+    region->large = NULL;
+    region->bump = NULL;
+    region->limit = NULL;
+    region->chunk_size = round_up(max(chunk_size, region_chunk_min), ALIGNMENT);
+    return region;
+}
+
+/*
+ * mm_region_alloc: returns size bytes aligned to ALIGNMENT from region, or
+ *                  NULL if size is 0 or memory ran out. The common case
+ *                  only moves the bump pointer of the current chunk.
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size)
+{
+    if (size == 0 || size > SIZE_MAX - region->chunk_size)
+    {
+        return NULL;
+    }
+    size = round_up(size, ALIGNMENT);
+    if (size <= (size_t)(region->limit - region->bump))
+    {
+        void *bp = region->bump;
+        region->bump += size;
+        return bp;
+    }
+    return region_refill(region, size);
+}
+
+/*
+ * mm_region_reset: frees every object of region at once. Its chunks are
+ *                  kept and bump allocated again from the first one; only
+ *                  the chunks of large objects are freed.
+ */
+void mm_region_reset(mm_region_t *region)
+{
+    region_chunk_t *chunk = region->large;
+
+    while (chunk != NULL)
+    {
+        region_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    region->large = NULL;
+    region->current = NULL;
+    region->bump = NULL;
+    region->limit = NULL;
+}
+
+/*
+ * mm_region_destroy: frees region with all its objects and chunks.
+ */
+void mm_region_destroy(mm_region_t *region)
+{
+    if (region == NULL)
+    {
+        return;
+    }
+    mm_region_reset(region);
+    region_chunk_t *chunk = region->chunks;
+    while (chunk != NULL)
+    {
+        region_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(region);
+}
+
+/*
+ * realloc: returns a pointer to an allocated region of at least size bytes:
+ *          if ptrv is NULL, then call malloc(size);
+ *          if size == 0, then call free(ptr) and returns NULL;
+ *          if the block can be resized where it is (see heap_resize), or a
+ *          slab object is of the size class of size, returns ptr (so that
+ *          free_sized can derive the class from size); a heap block growing
+ *          to the mmap threshold or beyond is moved to a mapping instead;
+ *          a mapped block that stays above the mmap threshold is mremapped;
+ *          else allocates new region of memory, copies old data to new memory,
+ *          and then free old block. Returns old block if realloc fails or
+ *          returns new pointer on success.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    LATENCY_SCOPE(MM_LAT_REALLOC);
+    size_t copysize;
+    void *newptr;
+    bool resized;
+
+    // If size == 0, then free block and return NULL
+    if (size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL)
+    {
+        return malloc(size);
+    }
+
+    if (is_slab(ptr))
+    {
+        if (size <= slab_max_size && slab_class(size) == slab_of(ptr)->cls)
+        {
+            return ptr;
+        }
+    }
+    else if (is_sampled(payload_to_header(ptr)))
+    {
+        // Moved, so that free retires the sample with the old block
+    }
+    else if (is_mmapped(payload_to_header(ptr)))
+    {
+        if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+        {
+            size_t oldsize = usable_size(ptr);
+            newptr = mmap_realloc(payload_to_header(ptr), size);
+            if (newptr != NULL)
+            {
+                stats_count(usable_size(newptr), oldsize, 0, 0);
+            }
+            return newptr;
+        }
+    }
+    else
+    {
+        if (size > SIZE_MAX - dsize - wsize)
+        {
+            // size + wsize would wrap around to a tiny block
+            return NULL;
+        }
+        size_t asize = max(round_up(size+wsize,dsize), min_block_size);
+        block_t *block = payload_to_header(ptr);
+        arena_t *a = arena_of(block);
+        size_t oldsize = get_payload_size(block);
+        // Growing past the mmap threshold moves the block to a mapping
+        bool to_mmap = asize > get_size(block)
+                       && size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+        resized = false;
+        if (!to_mmap)
+        {
+            pthread_mutex_lock(&a->lock);
+            resized = heap_resize(a, block, asize);
+            pthread_mutex_unlock(&a->lock);
+        }
+        if (resized)
+        {
+            stats_count(get_payload_size(block), oldsize, 0, 0);
+            return ptr;
+        }
+    }
+
+    // Otherwise, proceed with reallocation
+    newptr = malloc(size);
+    // If malloc fails, the original block is left untouched
+    if (!newptr)
+    {
+        return NULL;
+    }
+
+    // Copy the old data
+    copysize = usable_size(ptr); // gets size of old payload
+    if(size < copysize)
+    {
+        copysize = size;
+    }
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block
+    free(ptr);
+
+    return newptr;
+}
+
+/*
+ * calloc: Allocates a block with size at least (elements * size + dsize)
+ *         and initializes all bits in allocated memory to 0; memory that
+ *         is fresh from the OS is not written again (see allocate).
+ *         Returns NULL on failure.
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    LATENCY_SCOPE(MM_LAT_CALLOC);
+    size_t asize = nmemb * size;
+
+    if (nmemb != 0 && asize/nmemb != size)
+    // Multiplication overflowed
+    return NULL;
+    
+    return allocate(asize, true);
+}
+
+/*
+ * posix_memalign: stores in *memptr a block of size bytes aligned to
+ *                 alignment, which must be a power of two multiple of
+ *                 sizeof(void *). Returns 0, EINVAL for a bad alignment
+ *                 or ENOMEM, leaving *memptr alone, on failure.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *bp;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    bp = allocate_aligned(alignment, size);
+    if (bp == NULL && size != 0)
+    {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+/*
+ * aligned_alloc: allocates size bytes aligned to alignment, a power of two.
+ *                Returns NULL with errno set to EINVAL for any other
+ *                alignment, or NULL on failure.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate_aligned(alignment, size);
+}
+
+/*
+ * memalign: allocates size bytes aligned to alignment; like glibc, an
+ *           alignment that is not a power of two is rounded up to one.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    if (alignment > SIZE_MAX / 2 + 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((alignment & (alignment - 1)) != 0)
+    {
+        alignment = (size_t)1 << fls_size(alignment) << 1;
+    }
+    return allocate_aligned(alignment, size);
+}
+
+/*
+ * valloc: allocates size bytes aligned to a page.
+ */
+void *valloc(size_t size)
+{
+    return allocate_aligned(mmap_page_size, size);
+}
+
+/*
+ * pvalloc: allocates size bytes rounded up to a whole number of pages,
+ *          aligned to a page.
+ */
+void *pvalloc(size_t size)
+{
+    if (size > SIZE_MAX - mmap_page_size)
+    {
+        return NULL;
+    }
+    return allocate_aligned(mmap_page_size, round_up(max(size, 1), mmap_page_size));
+}
+
+/*
+ * mm_mallopt: sets allocator parameter param (see mm_ext.h) to value.
+ *             Returns false if param is unknown or value is out of range.
+ */
+bool mm_mallopt(int param, size_t value)
+{
+    switch (param)
+    {
+    case MM_OPT_MMAP_THRESHOLD:
+        if (value > mmap_threshold_max)
+        {
+            return false;
+        }
+        __atomic_store_n(&mmap_threshold_dynamic, false, __ATOMIC_RELAXED);
+        __atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_TRIM_THRESHOLD:
+        __atomic_store_n(&mmap_threshold_dynamic, false, __ATOMIC_RELAXED);
+        __atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_PURGE_THRESHOLD:
+        __atomic_store_n(&purge_threshold, value, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_DIRTY_DECAY_MS:
+        if (value > LONG_MAX)
+        {
+            return false;
+        }
+        __atomic_store_n(&dirty_decay_ms, (long)value, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_BACKGROUND_THREAD:
+        return background_thread_enable(value != 0);
+    case MM_OPT_FIT_POLICY:
+        if (value > MM_FIT_ADDRESS_BEST)
+        {
+            return false;
+        }
+        __atomic_store_n(&fit_policy, (int)value, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_PROF_SAMPLE:
+        if (value > prof_sample_max)
+        {
+            return false;
+        }
+        __atomic_store_n(&prof_sample_bytes, value, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_HEAP_GROW_MAX:
+        if (value > arena_reserve)
+        {
+            return false;
+        }
+        __atomic_store_n(&heap_grow_max, value, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_PREFAULT:
+        __atomic_store_n(&heap_prefault, value != 0, __ATOMIC_RELAXED);
+        return true;
+    case MM_OPT_HUGE_PAGES:
+        __atomic_store_n(&heap_huge_pages, value != 0, __ATOMIC_RELAXED);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * mm_purge_now: gives the memory of every large free block back to the OS
+ *               right away, whatever the decay time; meant for idle points.
+ */
+void mm_purge_now(void)
+{
+    decay_all(true);
+}
+
+/*
+ * mm_stats: fills in stats (see mm_ext.h). Thread counters are summed
+ *           without stopping their threads, so they are only consistent
+ *           with each other once the program is quiet; arenas are locked
+ *           one at a time while their free blocks, fast bins and remote
+ *           frees are counted. Nothing is drained or consolidated, so
+ *           reading the statistics leaves the heap as it was.
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(stats, &stats_retired);
+    for (tcache_t *cache = stats_threads; cache != NULL; cache = cache->next)
+    {
+        stats_sum(stats, &cache->stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    stats->mapped = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&slab_lock);
+    stats->slab_size = slab_brk - slab_base;
+    pthread_mutex_unlock(&slab_lock);
+
+    pthread_mutex_lock(&arenas_lock);
+    for (int i = 0; i < ARENA_MAX; i++)
+    {
+        arena_t *a = arenas[i];
+        if (a != NULL && a->heap_listp != NULL)
+        {
+            pthread_mutex_lock(&a->lock);
+            arena_stats(a, stats);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (stats->free_bytes > 0)
+    {
+        stats->fragmentation = 1.0 - (double)stats->largest_free / stats->free_bytes;
+    }
+}
+
+/*
+ * mm_footprint: returns the bytes of arena heaps, slabs and mapped blocks,
+ *               locking each arena only to read its heap size, without
+ *               the walks over free blocks and remote frees of mm_stats.
+ */
+size_t mm_footprint(void)
+{
+    size_t bytes = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&slab_lock);
+    bytes += slab_brk - slab_base;
+    pthread_mutex_unlock(&slab_lock);
+
+    pthread_mutex_lock(&arenas_lock);
+    for (int i = 0; i < ARENA_MAX; i++)
+    {
+        arena_t *a = arenas[i];
+        if (a != NULL && a->heap_listp != NULL)
+        {
+            pthread_mutex_lock(&a->lock);
+            bytes += (char *)a->epilogue + wsize - (char *)a->prologue;
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return bytes;
+}
+
+/*
+ * mm_stats_print: prints mm_stats to stderr, followed by every free list
+ *                 (see print_list) if lists is set.
+ */
+void mm_stats_print(bool lists)
+{
+    mm_stats_t stats;
+
+    mm_stats(&stats);
+    fprintf(stderr, "allocated %zu bytes in %llu mallocs, %llu frees\n",
+            stats.allocated, (unsigned long long)stats.nmalloc,
+            (unsigned long long)stats.nfree);
+    fprintf(stderr, "heap %zu, slabs %zu, mapped %zu bytes\n",
+            stats.heap_size, stats.slab_size, stats.mapped);
+    fprintf(stderr, "free %zu bytes in %zu blocks, largest %zu, fragmentation %.3f\n",
+            stats.free_bytes, stats.free_blocks, stats.largest_free,
+            stats.fragmentation);
+    fprintf(stderr, "fast bins %zu, remote frees %zu bytes\n",
+            stats.fast_bytes, stats.remote_bytes);
+    for (int b = 0; b < MM_STATS_BUCKETS; b++)
+    {
+        if (stats.bucket_blocks[b] > 0)
+        {
+            fprintf(stderr, "  [2^%d, 2^%d): %zu blocks, %zu bytes\n", b, b + 1,
+                    stats.bucket_blocks[b], stats.bucket_bytes[b]);
+        }
+    }
+    fprintf(stderr, "extend_heap %llu, splits %llu, coalesce %llu/%llu/%llu/%llu\n",
+            (unsigned long long)stats.extend_heap, (unsigned long long)stats.splits,
+            (unsigned long long)stats.coalesce[0], (unsigned long long)stats.coalesce[1],
+            (unsigned long long)stats.coalesce[2], (unsigned long long)stats.coalesce[3]);
+    if (lists)
+    {
+        print_list();
+    }
+}
+
+/*
+ * mm_latency: fills in latency with the histograms of all threads. Returns
+ *             false, leaving them empty, unless built with LATENCY_HIST.
+ */
+bool mm_latency(mm_latency_t *latency)
+{
+    memset(latency, 0, sizeof(*latency));
+#if LATENCY_HIST
+    pthread_mutex_lock(&stats_lock);
+    latency_sum(latency, &stats_retired);
+    for (tcache_t *cache = stats_threads; cache != NULL; cache = cache->next)
+    {
+        latency_sum(latency, &cache->stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * mm_latency_print: prints, for every op that was timed, its number of
+ *                   calls and the cycles under which 50%, 99% and 99.9%
+ *                   and all of them completed, followed by its histogram.
+ */
+void mm_latency_print(void)
+{
+    mm_latency_t latency;
+
+    if (!mm_latency(&latency))
+    {
+        fprintf(stderr, "latency histograms are off, build with LATENCY_HIST\n");
+        return;
+    }
+    for (int op = 0; op < MM_LAT_OPS; op++)
+    {
+        const uint64_t *buckets = latency.buckets[op];
+        uint64_t total = 0;
+        for (int b = 0; b < MM_LAT_BUCKETS; b++)
+        {
+            total += buckets[b];
+        }
+        if (total == 0)
+        {
+            continue;
+        }
+        fprintf(stderr, "%s: %llu calls, p50 < %llu, p99 < %llu, p99.9 < %llu, max < %llu cycles\n",
+                latency_names[op], (unsigned long long)total,
+                (unsigned long long)latency_quantile(buckets, total, 0.5),
+                (unsigned long long)latency_quantile(buckets, total, 0.99),
+                (unsigned long long)latency_quantile(buckets, total, 0.999),
+                (unsigned long long)latency_quantile(buckets, total, 1.0));
+        for (int b = 0; b < MM_LAT_BUCKETS; b++)
+        {
+            if (buckets[b] > 0)
+            {
+                fprintf(stderr, "  [2^%d, 2^%d): %llu\n", b, b + 1,
+                        (unsigned long long)buckets[b]);
+            }
+        }
+    }
+}
+
+/*
+ * mm_prof_dump: writes the heap profile to path in the text format of
+ *               gperftools heap profiles (heap_v2), which pprof reads: a
+ *               line per sampled stack with its live and total sampled
+ *               objects and bytes, followed by the mappings of the
+ *               process. Returns false if path could not be written.
+ */
+bool mm_prof_dump(const char *path)
+{
+    prof_out_t out = { .ok = true, .len = 0 };
+    uint64_t inuse_count = 0, inuse_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    char maps[4096];
+    ssize_t n;
+
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out.fd < 0)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&prof_lock);
+    for (size_t i = 0; prof_stacks != NULL && i < PROF_STACKS; i++)
+    {
+        inuse_count += prof_stacks[i].inuse_count;
+        inuse_bytes += prof_stacks[i].inuse_bytes;
+        alloc_count += prof_stacks[i].alloc_count;
+        alloc_bytes += prof_stacks[i].alloc_bytes;
+    }
+    prof_write(&out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+               (unsigned long long)inuse_count, (unsigned long long)inuse_bytes,
+               (unsigned long long)alloc_count, (unsigned long long)alloc_bytes,
+               __atomic_load_n(&prof_sample_bytes, __ATOMIC_RELAXED));
+    for (size_t i = 0; prof_stacks != NULL && i < PROF_STACKS; i++)
+    {
+        prof_stack_t *stack = &prof_stacks[i];
+        if (stack->hash == 0)
+        {
+            continue;
+        }
+        prof_write(&out, "%llu: %llu [%llu: %llu] @",
+                   (unsigned long long)stack->inuse_count,
+                   (unsigned long long)stack->inuse_bytes,
+                   (unsigned long long)stack->alloc_count,
+                   (unsigned long long)stack->alloc_bytes);
+        for (int f = 0; f < stack->depth; f++)
+        {
+            prof_write(&out, " %p", stack->frames[f]);
+        }
+        prof_write(&out, "\n");
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    // pprof maps the addresses to symbols through the mappings
+    prof_write(&out, "\nMAPPED_LIBRARIES:\n");
+    prof_flush(&out);
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    while (fd >= 0 && (n = read(fd, maps, sizeof(maps))) > 0)
+    {
+        out.ok = out.ok && write(out.fd, maps, n) == n;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return close(out.fd) == 0 && out.ok;
+}
+
+/******** The remaining content below are helper and debug routines ********/
+
+/*
+ * heap_malloc: Seeks a sufficiently-large unallocated block on the heap for
+ *              asize bytes, taking a fast bin block of exactly that size
+ *              first. If no such block is found, the fast bins are
+ *              consolidated and searched again, then the heap is extended
+ *              by asize or the arena's growth step if larger, and all, or
+ *              a part of, that memory is allocated. If zeroed is not NULL, it
+ *              is set to whether the block was still zero (see is_zeroed).
+ *              Requires a's lock. Returns NULL on failure.
+ */
+static void *heap_malloc(arena_t *a, size_t asize, bool *zeroed)
+{
+    dbg_requires(check_arena(a, __LINE__));
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+
+    if (asize <= fastbin_max_size && a->fastbins[asize >> ALIGNMENT_LOG2] != NULL)
+    {
+        block = a->fastbins[asize >> ALIGNMENT_LOG2];
+        a->fastbins[asize >> ALIGNMENT_LOG2] = *(block_t **)block->payload;
+        a->fast_bytes -= asize;
+        if (zeroed != NULL)
+        {
+            *zeroed = false;
+        }
+        return header_to_payload(block);
+    }
+
+    // Search the free list for a fit
+    int index=get_index(asize);
+    block = find_fit(a, asize,index);
+    if (block == NULL && a->fast_bytes > 0)
+    {
+        arena_consolidate(a);
+        block = find_fit(a, asize, index);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL)
+    {   
+        extendsize = heap_grow_size(a, asize);
+        block = extend_heap(a, extendsize);
+        if (block == NULL) // extend_heap returns an error
+        {
+            return NULL;
+        }
+    }
+    if (zeroed != NULL)
+    {
+        *zeroed = is_zeroed(block);
+    }
+    place(a, block, asize);
+
+    // Release expired dirty memory if no background thread does
+    if (++a->decay_ticks >= decay_ticks)
+    {
+        a->decay_ticks = 0;
+        if (__atomic_load_n(&dirty_decay_ms, __ATOMIC_RELAXED) > 0
+            && !__atomic_load_n(&background_running, __ATOMIC_RELAXED))
+        {
+            arena_decay(a, now_ms(), false);
+        }
+    }
+    dbg_ensures(check_arena(a, __LINE__));
+    return header_to_payload(block);
+}
+
+/*
+ * heap_memalign: allocates a heap block of asize bytes whose payload is a
+ *                multiple of alignment. The first fit for asize is used if
+ *                it happens to be placed right, otherwise a fit for asize
+ *                plus the largest gap is found or made. The gap in front
+ *                of the aligned block goes back on the lists as a free
+ *                block of its own, and place splits off the rest.
+ *                Requires a's lock. Returns NULL on failure.
+ */
+static void *heap_memalign(arena_t *a, size_t alignment, size_t asize)
+{
+    dbg_requires(check_arena(a, __LINE__));
+    size_t search = asize + alignment + min_block_size;
+    block_t *block = find_fit(a, asize, get_index(asize));
+    size_t gap, size;
+
+    if (block == NULL || align_gap(block, alignment) + asize > get_size(block))
+    {
+        block = find_fit(a, search, get_index(search));
+        if (block == NULL && a->fast_bytes > 0)
+        {
+            arena_consolidate(a);
+            block = find_fit(a, search, get_index(search));
+        }
+        if (block == NULL)
+        {
+            block = extend_heap(a, heap_grow_size(a, search));
+            if (block == NULL)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    gap = align_gap(block, alignment);
+    if (gap > 0)
+    {
+        // The neighbour in front is allocated, so the gap stays on its own
+        bool purged = is_purged(block);
+        bool zeroed = is_zeroed(block);
+        word_t dirtied = ((word_t *)block->payload)[2];
+        block_t *aligned;
+
+        size = get_size(block);
+        dequeue(a, block, get_index(size));
+        write_header(block, gap, false);
+        write_footer(block, gap, false);
+        aligned = find_next(block);
+        aligned->header = pack(size - gap, false);
+        write_footer(aligned, size - gap, false);
+        set_purged(block, purged);
+        set_zeroed(block, zeroed);
+        set_purged(aligned, purged);
+        set_zeroed(aligned, zeroed);
+        if (!purged && gap >= mmap_page_size)
+        {
+            ((word_t *)block->payload)[2] = dirtied;
+        }
+        if (!purged && size - gap >= mmap_page_size)
+        {
+            ((word_t *)aligned->payload)[2] = dirtied;
+        }
+        enqueue(a, block, get_index(gap));
+        enqueue(a, aligned, get_index(size - gap));
+        block = aligned;
+    }
+    place(a, block, asize);
+    dbg_ensures(check_arena(a, __LINE__));
+    return header_to_payload(block);
+}
+
+/*
+ * heap_malloc_batch: allocates up to n heap blocks of asize bytes into
+ *                    ptrs, each free block used being carved up in one
+ *                    pass by place_run. A free block big enough for the
+ *                    whole batch is preferred, then any that fits one
+ *                    block, then the heap is extended by the whole batch.
+ *                    Requires a's lock. Returns the number allocated.
+ */
+static size_t heap_malloc_batch(arena_t *a, size_t asize, size_t n, void **ptrs)
+{
+    dbg_requires(check_arena(a, __LINE__));
+    size_t got = 0;
+
+    while (got < n)
+    {
+        size_t left = n - got;
+        size_t want = (left > SIZE_MAX / 2 / asize) ? asize : asize * left;
+        block_t *block = find_fit(a, want, get_index(want));
+
+        if (block == NULL)
+        {
+            block = find_fit(a, asize, get_index(asize));
+        }
+        if (block == NULL && a->fast_bytes > 0)
+        {
+            arena_consolidate(a);
+            block = find_fit(a, asize, get_index(asize));
+        }
+        if (block == NULL)
+        {
+            block = extend_heap(a, heap_grow_size(a, want));
+            if (block == NULL)
+            {
+                break;
+            }
+        }
+        got += place_run(a, block, asize, left, ptrs + got);
+    }
+    dbg_ensures(check_arena(a, __LINE__));
+    return got;
+}
+
+/*
+ * place_run: allocates as many as count blocks of asize bytes back to back
+ *            at the start of free block block, storing their payloads in
+ *            ptrs. What is left goes back on the lists as in place, or to
+ *            the last block if too small. Requires a's lock. Returns the
+ *            number of blocks allocated.
+ */
+static size_t place_run(arena_t *a, block_t *block, size_t asize, size_t count, void **ptrs)
+{
+    size_t csize = get_size(block);
+    bool purged = is_purged(block);
+    bool zeroed = is_zeroed(block);
+    word_t dirtied = ((word_t *)block->payload)[2];
+    size_t rest;
+
+    dequeue(a, block, get_index(csize));
+    if (count > csize / asize)
+    {
+        count = csize / asize;
+    }
+    rest = csize - count * asize;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            block->header = prev_alloc_mask;
+        }
+        if (i == count - 1 && rest < min_block_size)
+        {
+            write_header(block, asize + rest, true);
+        }
+        else
+        {
+            write_header(block, asize, true);
+        }
+        ptrs[i] = header_to_payload(block);
+        block = find_next(block);
+    }
+
+    if (rest >= min_block_size)
+    {
+        a->nsplit++;
+        block->header = prev_alloc_mask;
+        write_header(block, rest, false);
+        write_footer(block, rest, false);
+        set_purged(block, purged);
+        set_zeroed(block, zeroed);
+        if (!purged && rest >= mmap_page_size)
+        {
+            ((word_t *)block->payload)[2] = dirtied;
+        }
+        enqueue(a, block, get_index(rest));
+    }
+    else
+    {
+        set_previous_allocated(block);
+    }
+    return count;
+}
+
+/*
+ * sort_addresses: sorts ptrs by address, in place and without allocating
+ *                 (heapsort), since qsort may call malloc.
+ */
+static void sort_addresses(void **ptrs, size_t n)
+{
+    // Batches from mm_malloc_batch usually come back already in order
+    size_t sorted = 1;
+    while (sorted < n && (uintptr_t)ptrs[sorted - 1] <= (uintptr_t)ptrs[sorted])
+    {
+        sorted++;
+    }
+    if (sorted >= n)
+    {
+        return;
+    }
+
+    // Build a max heap, then move its top to the end one at a time
+    for (size_t root = n / 2; root-- > 0; )
+    {
+        sift_down(ptrs, root, n);
+    }
+    for (size_t end = n; end-- > 1; )
+    {
+        void *top = ptrs[0];
+        ptrs[0] = ptrs[end];
+        ptrs[end] = top;
+        sift_down(ptrs, 0, end);
+    }
+}
+
+/*
+ * sift_down: moves ptrs[root] down the max heap of the first end entries
+ *            of ptrs until neither of its children is larger.
+ */
+static void sift_down(void **ptrs, size_t root, size_t end)
+{
+    while (2 * root + 1 < end)
+    {
+        size_t child = 2 * root + 1;
+        if (child + 1 < end && (uintptr_t)ptrs[child] < (uintptr_t)ptrs[child + 1])
+        {
+            child++;
+        }
+        if ((uintptr_t)ptrs[root] >= (uintptr_t)ptrs[child])
+        {
+            return;
+        }
+        void *tmp = ptrs[root];
+        ptrs[root] = ptrs[child];
+        ptrs[child] = tmp;
+        root = child;
+    }
+}
+
+/*
+ * region_refill: the slow path of mm_region_alloc, size being a multiple
+ *                of ALIGNMENT that does not fit in the current chunk. A
+ *                large object gets a chunk of its own; otherwise
+ *                allocation moves on to the next chunk, reusing one
+ *                kept by mm_region_reset if there is one. Returns NULL if
+ *                out of memory.
+ */
+static void *region_refill(mm_region_t *region, size_t size)
+{
+    size_t room = region->chunk_size - sizeof(region_chunk_t);
+    region_chunk_t *chunk;
+
+    if (size > room / 4)
+    {
+        chunk = malloc(sizeof(region_chunk_t) + size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->size = sizeof(region_chunk_t) + size;
+        chunk->next = region->large;
+        region->large = chunk;
+        return chunk->data;
+    }
+
+    chunk = (region->current != NULL) ? region->current->next : region->chunks;
+    if (chunk == NULL)
+    {
+        chunk = malloc(region->chunk_size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->size = region->chunk_size;
+        chunk->next = NULL;
+        if (region->current != NULL)
+        {
+            region->current->next = chunk;
+        }
+        else
+        {
+            region->chunks = chunk;
+        }
+    }
+    region->current = chunk;
+    region->bump = chunk->data + size;
+    region->limit = (char *)chunk + chunk->size;
+    return chunk->data;
+}
+
+/*
+ * align_gap: returns the number of bytes from free block block to the
+ *            first block after it whose payload is a multiple of
+ *            alignment, leaving room for a free block in between.
+ */
+static size_t align_gap(block_t *block, size_t alignment)
+{
+    uintptr_t payload = (uintptr_t)header_to_payload(block);
+    size_t gap = round_up(payload, alignment) - payload;
+
+    while (gap > 0 && gap < min_block_size)
+    {
+        gap += alignment;
+    }
+    return gap;
+}
+
+/*
+ * heap_free: marks an allocated block free and coalesces it into the
+ *            segregated lists of its arena a. Requires a's lock.
+ */
+static void heap_free(arena_t *a, block_t *block)
+{
+    size_t size = get_size(block);
+    block_t *block_next = find_next(block);
+    // If every free neighbour was purged, only this block's pages are dirty
+    bool neighbours_purged =
+        (is_previous_allocated(block) || is_purged(find_prev(block)))
+        && (get_alloc(block_next) || is_purged(block_next));
+
+    write_header(block, size, false);
+    write_footer(block, size, false);
+    block_t *merged = coalesce(a, block);
+    heap_release(a, merged, neighbours_purged ? block : merged);
+    dbg_ensures(check_arena(a, __LINE__));
+}
+
+/*
+ * heap_release: gives the memory of a newly freed (and coalesced) block
+ *               back to the OS once it reaches release_size. dirty is the
+ *               part of it that was not purged yet. With a dirty decay
+ *               time the block is only timestamped, for arena_decay to
+ *               release later. Requires a's lock.
+ */
+static void heap_release(arena_t *a, block_t *block, block_t *dirty)
+{
+    if (get_size(block) < release_size(a, block) || is_purged(block))
+    {
+        return;
+    }
+    if (__atomic_load_n(&dirty_decay_ms, __ATOMIC_RELAXED) > 0)
+    {
+        ((word_t *)block->payload)[2] = now_ms();
+        return;
+    }
+    release_block(a, block, dirty);
+}
+
+/*
+ * release_size: returns the size from which a free block's memory is given
+ *               back: purge_threshold, or trim_threshold if that is lower
+ *               and the block is at the top of its arena.
+ */
+static size_t release_size(arena_t *a, block_t *block)
+{
+    size_t purge = __atomic_load_n(&purge_threshold, __ATOMIC_RELAXED);
+    size_t trim = __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED);
+    size_t page = purge_page_size();
+
+    // Smaller blocks have no whole page to release
+    if (find_next(block) == a->epilogue && trim < purge)
+    {
+        return max(trim, page);
+    }
+    return max(purge, page);
+}
+
+/*
+ * release_block: gives the memory of a large free block back now. The top
+ *                block of an arena other than the main one is trimmed
+ *                beyond trim_threshold; otherwise the pages the block
+ *                shares with dirty are purged. Requires a's lock.
+ */
+static void release_block(arena_t *a, block_t *block, block_t *dirty)
+{
+    size_t size = get_size(block);
+
+    if (a != &main_arena && find_next(block) == a->epilogue
+        && size >= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED))
+    {
+        arena_trim(a, block);
+        return;
+    }
+
+    // Keep the header, links or tree node, timestamp and footer resident
+    char *lo = (char *)header_to_payload(block) + 4 * wsize;
+    char *hi = (char *)block + size - wsize;
+    if ((char *)dirty > lo)
+    {
+        lo = (char *)dirty;
+    }
+    if ((char *)dirty + get_size(dirty) < hi)
+    {
+        hi = (char *)dirty + get_size(dirty);
+    }
+    purge_pages(lo, hi);
+    set_purged(block, true);
+}
+
+/*
+ * arena_decay: releases the large dirty free blocks of a that have stayed
+ *              free for dirty_decay_ms, or all of them if force is set.
+ *              Only the lists and tree nodes of sizes from which blocks are
+ *              released are walked. Requires a's lock.
+ */
+static void arena_decay(arena_t *a, uint64_t now, bool force)
+{
+    size_t purge = __atomic_load_n(&purge_threshold, __ATOMIC_RELAXED);
+    size_t trim = __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED);
+    size_t min_size = max(trim < purge ? trim : purge, mmap_page_size);
+    int index = find_nonempty_list(a, get_index(min_size));
+    block_t *block, *next;
+
+    while (index >= 0)
+    {
+        block = a->free_list[index];
+        while (block != NULL)
+        {
+            // Read first, release_block may move the block to another list
+            next = (block_t *)(((word_t *)block->payload)[1]);
+            decay_block(a, block, now, force);
+            block = next;
+        }
+        index = (index + 1 < NUM_LISTS) ? find_nonempty_list(a, index + 1) : -1;
+    }
+    // A trimmed block is reinserted with a smaller key, behind the walk
+    for (block = tree_find(a, min_size, true); block != NULL; block = next)
+    {
+        next = tree_next(block);
+        decay_block(a, block, now, force);
+    }
+}
+
+/*
+ * decay_block: releases free block of a if it is large enough and dirty
+ *              for dirty_decay_ms already, or force is set.
+ *              Requires a's lock.
+ */
+static void decay_block(arena_t *a, block_t *block, uint64_t now, bool force)
+{
+    uint64_t decay = (uint64_t)__atomic_load_n(&dirty_decay_ms, __ATOMIC_RELAXED);
+    uint64_t dirtied = ((word_t *)block->payload)[2];
+
+    if (!is_purged(block) && get_size(block) >= release_size(a, block)
+        && (force || (dirtied <= now && now - dirtied >= decay)))
+    {
+        release_block(a, block, block);
+    }
+}
+
+/*
+ * decay_all: runs arena_decay on every arena, after draining its remote
+ *            frees and consolidating its fast bins; this also empties the
+ *            queues and bins of arenas no thread allocates from any more.
+ */
+static void decay_all(bool force)
+{
+    uint64_t now = now_ms();
+
+    // Holding arenas_lock keeps arenas from being created meanwhile
+    pthread_mutex_lock(&arenas_lock);
+    for (int i = 0; i < ARENA_MAX; i++)
+    {
+        arena_t *a = arenas[i];
+        if (a != NULL && a->heap_listp != NULL)
+        {
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            arena_consolidate(a);
+            arena_decay(a, now, force);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+/*
+ * background_thread: wakes background_wakeups times per decay period to
+ *                    release expired dirty memory of all arenas, until it
+ *                    is disabled.
+ */
+static void *background_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&background_lock);
+    while (background_enabled)
+    {
+        long decay = __atomic_load_n(&dirty_decay_ms, __ATOMIC_RELAXED);
+        long interval = (decay > 0) ? decay / background_wakeups : 1000;
+        struct timespec deadline;
+
+        if (interval < 1)
+        {
+            interval = 1;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&background_cond, &background_lock, &deadline);
+        if (!background_enabled)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&background_lock);
+        if (decay > 0)
+        {
+            decay_all(false);
+        }
+        pthread_mutex_lock(&background_lock);
+    }
+    __atomic_store_n(&background_running, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&background_lock);
+    return NULL;
+}
+
+/*
+ * background_thread_enable: starts the background thread, or asks it to
+ *                           stop. Returns false if it cannot be started.
+ */
+static bool background_thread_enable(bool enable)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&background_lock);
+    background_enabled = enable;
+    if (enable && !background_running)
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ok = (pthread_create(&thread, &attr, background_thread, NULL) == 0);
+        pthread_attr_destroy(&attr);
+        background_enabled = ok;
+        __atomic_store_n(&background_running, ok, __ATOMIC_RELAXED);
+    }
+    else if (!enable)
+    {
+        pthread_cond_signal(&background_cond);
+    }
+    pthread_mutex_unlock(&background_lock);
+    return ok;
+}
+
+/*
+ * now_ms: returns a monotonic time in milliseconds.
+ */
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * arena_trim: shrinks the free top block of an arena other than the main
+ *             one to about chunksize bytes, moves the epilogue down and
+ *             lowers the arena's break to the next page boundary (of
+ *             purge_page_size), purging
+ *             everything above it. Growth starts over from chunksize.
+ *             Requires a's lock.
+ */
+static void arena_trim(arena_t *a, block_t *block)
+{
+    size_t size = get_size(block);
+    // Size that leaves the break (just above the epilogue) page aligned
+    size_t page = purge_page_size();
+    char *top = (char *)round_up((size_t)block + chunksize + wsize, page);
+    size_t keep = top - wsize - (char *)block;
+    char *old_brk = a->brk;
+
+    if (keep >= size)
+    {
+        return;
+    }
+    dequeue(a, block, get_index(size));
+    write_header(block, keep, false);
+    write_footer(block, keep, false);
+    enqueue(a, block, get_index(keep));
+
+    a->epilogue = find_next(block);
+    a->epilogue->header = pack(0, true);
+    a->brk = top;
+    a->grow = chunksize;
+    // The rest of the old break's page is the arena's too, and must come
+    // back zero since extend_heap takes memory above the break as zeroed
+    purge_pages(top, (char *)round_up((size_t)old_brk, page));
+}
+
+/*
+ * purge_pages: releases the whole pages within [lo, hi) to the OS, huge
+ *              pages if the heap is laid out for them (see purge_page_size).
+ */
+static void purge_pages(void *lo, void *hi)
+{
+    size_t page = purge_page_size();
+    char *start = (char *)round_up((size_t)lo, page);
+    char *end = (char *)((size_t)hi & ~(page - 1));
+
+    if (end > start)
+    {
+        madvise(start, end - start, PURGE_ADVICE);
+    }
+}
+
+/*
+ * prefault_pages: backs the pages of [lo, lo + size) now, so that the
+ *                 allocations using them later do not fault. Their contents
+ *                 are left as they are.
+ */
+static void prefault_pages(void *lo, size_t size)
+{
+    char *end = (char *)lo + size;
+
+#ifdef MADV_POPULATE_WRITE
+    char *start = (char *)((size_t)lo & ~(mmap_page_size - 1));
+    if (madvise(start, end - start, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+#endif
+    // Kernels before 5.14: write to every page
+    for (char *p = (char *)round_up((size_t)lo, mmap_page_size); p < end; p += mmap_page_size)
+    {
+        *(volatile char *)p = *(volatile char *)p;
+    }
+}
+
+/*
+ * advise_huge_pages: asks for the whole huge pages within [lo, hi) to be
+ *                    backed by transparent huge pages.
+ */
+static void advise_huge_pages(void *lo, void *hi)
+{
+#ifdef MADV_HUGEPAGE
+    char *start = (char *)round_up((size_t)lo, huge_page_size);
+    char *end = (char *)((size_t)hi & ~(huge_page_size - 1));
+
+    if (end > start)
+    {
+        madvise(start, end - start, MADV_HUGEPAGE);
+    }
+#else
+    (void)lo;
+    (void)hi;
+#endif
+}
+
+/*
+ * purge_page_size: returns the unit in which free memory is given back:
+ *                  huge_page_size if the heap is laid out for huge pages,
+ *                  else mmap_page_size.
+ */
+static size_t purge_page_size(void)
+{
+    return __atomic_load_n(&heap_huge_pages, __ATOMIC_RELAXED) ? huge_page_size : mmap_page_size;
+}
+
+/*
+ * heap_grow_size: returns how far to extend the heap of a for want more
+ *                 bytes: want, or the arena's growth step if that is
+ *                 larger, and doubles the step (see heap_grow_ratio). For
+ *                 huge pages, a step of a huge page or more is stretched
+ *                 to end on a huge page boundary. Requires a's lock.
+ */
+static size_t heap_grow_size(arena_t *a, size_t want)
+{
+    size_t limit = __atomic_load_n(&heap_grow_max, __ATOMIC_RELAXED);
+    size_t heap = (char *)a->epilogue + wsize - (char *)a->prologue;
+    size_t step = max(min(a->grow, min(limit, heap / heap_grow_ratio)), chunksize);
+    size_t brk = (size_t)a->epilogue + wsize;
+
+    if (a->grow < limit)
+    {
+        a->grow = min(2 * a->grow, limit);
+    }
+    step = max(want, step);
+    if (step >= huge_page_size && __atomic_load_n(&heap_huge_pages, __ATOMIC_RELAXED))
+    {
+        step = round_up(brk + step, huge_page_size) - brk;
+    }
+    return step;
+}
+
+/*
+ * heap_resize: resizes an allocated block to asize bytes without moving it.
+ *              Growing absorbs the next block if it is free; if that is not
+ *              enough and the block is the last one before the epilogue
+ *              (possibly followed by a free block), the heap is extended
+ *              first. The block is then trimmed to asize. Returns false,
+ *              leaving the block untouched, if it cannot grow in place.
+ *              Requires a's lock.
+ */
+static bool heap_resize(arena_t *a, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    block_t *block_next = find_next(block);
+
+    if (asize > csize)
+    {
+        size_t avail = csize;
+        block_t *top = block_next;
+        if (!get_alloc(block_next))
+        {
+            avail += get_size(block_next);
+            top = find_next(block_next);
+        }
+        if (avail < asize)
+        {
+            if (top != a->epilogue)
+            {
+                return false;
+            }
+            // The new space coalesces with a free block_next, if any
+            if (extend_heap(a, heap_grow_size(a, asize - avail)) == NULL)
+            {
+                return false;
+            }
+            block_next = find_next(block);
+        }
+        dequeue(a, block_next, get_index(get_size(block_next)));
+        write_header(block, csize + get_size(block_next), true);
+        set_previous_allocated(find_next(block));
+    }
+    heap_trim(a, block, asize);
+    dbg_ensures(check_arena(a, __LINE__));
+    return true;
+}
+
+/*
+ * heap_trim: shrinks an allocated block to asize bytes if the rest is at
+ *            least min_block_size, freeing the rest (which coalesces with
+ *            a free next block). No footer is written for the allocated
+ *            part, as its last word is payload. Requires a's lock.
+ */
+static void heap_trim(arena_t *a, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    block_t *rest;
+
+    if (csize - asize < min_block_size)
+    {
+        return;
+    }
+    write_header(block, asize, true);
+    rest = find_next(block);
+    rest->header = pack(csize - asize, true) | prev_alloc_mask;
+    heap_free(a, rest);
+}
+
+/*
+ * clear_payload: zeroes the first size bytes of a newly allocated block.
+ *                If the block was zeroed before it was placed, only the
+ *                words a free block writes into its payload are cleared:
+ *                the free list links or tree node, the decay timestamp and
+ *                its footer.
+ */
+static void clear_payload(void *bp, size_t size, bool zeroed)
+{
+    if (!zeroed)
+    {
+        memset(bp, 0, size);
+        return;
+    }
+    size_t payload = get_payload_size(payload_to_header(bp));
+    memset(bp, 0, (payload < 4 * wsize) ? payload : 4 * wsize);
+    memset((char *)bp + payload - wsize, 0, wsize);
+}
+
+/*
+ * arena_malloc: allocates from the calling thread's arena, falling back to
+ *               the main arena if that is exhausted. A cached bin is
+ *               refilled in bulk, otherwise a single heap block of asize
+ *               bytes is allocated and zeroed is set as by heap_malloc.
+ */
+static void *arena_malloc(int bin, size_t asize, bool *zeroed)
+{
+    arena_t *a = thread_arena();
+    void *bp;
+
+    while (true)
+    {
+        pthread_mutex_lock(&a->lock);
+        arena_drain(a);
+        if (bin >= 0)
+        {
+            bp = tcache_fill(a, bin, asize);
+        }
+        else
+        {
+            bp = heap_malloc(a, asize, zeroed);
+        }
+        pthread_mutex_unlock(&a->lock);
+        if (bp != NULL || a == &main_arena)
+        {
+            return bp;
+        }
+        a = &main_arena;
+    }
+}
+
+/*
+ * bin_malloc: allocates one object for thread cache bin from arena a: a
+ *             slab object for slab bins, a heap block of asize bytes
+ *             otherwise. Requires a's lock.
+ */
+static void *bin_malloc(arena_t *a, int bin, size_t asize)
+{
+    if (bin >= TCACHE_HEAP_BINS)
+    {
+        return slab_malloc(a, bin - TCACHE_HEAP_BINS);
+    }
+    return heap_malloc(a, asize, NULL);
+}
+
+/*
+ * arena_free: returns a slab object or heap block owned by a, small heap
+ *             blocks going to the fast bins. Requires a's lock.
+ */
+static void arena_free(arena_t *a, void *bp)
+{
+    if (is_slab(bp))
+    {
+        slab_free(a, bp);
+    }
+    else if (get_size(payload_to_header(bp)) <= fastbin_max_size)
+    {
+        fastbin_put(a, payload_to_header(bp));
+    }
+    else
+    {
+        heap_free(a, payload_to_header(bp));
+    }
+}
+
+/*
+ * fastbin_put: puts an allocated block of at most fastbin_max_size bytes
+ *              on its fast bin, consolidating the fast bins if they grow
+ *              past fastbin_consolidate_bytes. Requires a's lock.
+ */
+static void fastbin_put(arena_t *a, block_t *block)
+{
+    size_t size = get_size(block);
+
+    *(block_t **)block->payload = a->fastbins[size >> ALIGNMENT_LOG2];
+    a->fastbins[size >> ALIGNMENT_LOG2] = block;
+    a->fast_bytes += size;
+    if (a->fast_bytes > fastbin_consolidate_bytes)
+    {
+        arena_consolidate(a);
+    }
+}
+
+/*
+ * arena_consolidate: frees and coalesces every fast bin block of a.
+ *                    Requires a's lock.
+ */
+static void arena_consolidate(arena_t *a)
+{
+    for (int bin = 0; bin < FASTBIN_COUNT && a->fast_bytes > 0; bin++)
+    {
+        block_t *block;
+        while ((block = a->fastbins[bin]) != NULL)
+        {
+            a->fastbins[bin] = *(block_t **)block->payload;
+            a->fast_bytes -= get_size(block);
+            heap_free(a, block);
+        }
+    }
+}
+
+/*
+ * remote_push: hands the objects from first to last, linked through their
+ *              first words and all owned by a, over to a without taking
+ *              its lock. Any number of threads may push at once; a's lock
+ *              holder drains them (see arena_drain). If no thread allocates
+ *              from a any more, the pusher drains them itself. May be
+ *              called holding the lock of the caller's own arena only.
+ */
+static void remote_push(arena_t *a, void *first, void *last)
+{
+    void *head = __atomic_load_n(&a->remote_free, __ATOMIC_RELAXED);
+
+    // Sequentially consistent with the last thread leaving a, so that
+    // either it drains this push or the load of threads below sees 0
+    do
+    {
+        *(void **)last = head;
+    }
+    while (!__atomic_compare_exchange_n(&a->remote_free, &head, first, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+#if !ARENA_BY_CPU
+    if (__atomic_load_n(&a->threads, __ATOMIC_SEQ_CST) == 0)
+    {
+        pthread_mutex_lock(&a->lock);
+        arena_drain(a);
+        pthread_mutex_unlock(&a->lock);
+    }
+#endif
+}
+
+/*
+ * arena_drain: frees every object queued on a by remote_push. The whole
+ *              list is taken at once, so pushers never race with a pop
+ *              (no ABA). Requires a's lock.
+ */
+static void arena_drain(arena_t *a)
+{
+    void *bp;
+
+    if (__atomic_load_n(&a->remote_free, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+    bp = __atomic_exchange_n(&a->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (bp != NULL)
+    {
+        void *next = *(void **)bp;
+        arena_free(a, bp);
+        bp = next;
+    }
+}
+
+/*
+ * owner_arena: returns the arena owning a slab object or heap block.
+ */
+static arena_t *owner_arena(void *bp)
+{
+    if (is_slab(bp))
+    {
+        return slab_of(bp)->arena;
+    }
+    return arena_of(payload_to_header(bp));
+}
+
+/*
+ * usable_size: returns the number of bytes usable at bp, the object size
+ *              for slab objects and the payload size for blocks.
+ */
+static size_t usable_size(void *bp)
+{
+    if (is_slab(bp))
+    {
+        return slab_of(bp)->size;
+    }
+    if (is_mmapped(payload_to_header(bp)))
+    {
+        // The mapping also holds what lies before the header
+        block_t *block = payload_to_header(bp);
+        return mmap_start(block) + get_size(block) - (char *)bp;
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
+/*
+ * cached_size: returns the usable size of bp, an object of thread cache bin
+ *              bin. A slab object's follows from its bin, so that counting
+ *              it needs no slab header; a heap block may have absorbed a
+ *              remainder too small to split, so its header is read, next
+ *              to bp.
+ */
+static size_t cached_size(void *bp, int bin)
+{
+    if (bin >= TCACHE_HEAP_BINS)
+    {
+        return (size_t)(bin - TCACHE_HEAP_BINS + 1) << ALIGNMENT_LOG2;
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
+/*
+ * is_mmapped: returns true if an allocated block has a mapping of its own.
+ */
+static bool is_mmapped(block_t *block)
+{
+    return (block->header & mmapped_mask) != 0;
+}
+
+/*
+ * mmap_malloc: maps a block for a request of size bytes whose payload is a
+ *              multiple of alignment. Its size field is the size of the
+ *              whole mapping. Alignments beyond a page are met by mapping
+ *              more and unmapping the slack. Returns NULL on failure.
+ */
+static void *mmap_malloc(size_t size, size_t alignment)
+{
+    // Offset of the payload into the mapping, keeping the header in page 0
+    size_t offset = (alignment < mmap_page_size) ? max(alignment, dsize) : mmap_page_size;
+    size_t extra = (alignment > mmap_page_size) ? alignment - mmap_page_size : 0;
+    bool huge = __atomic_load_n(&heap_huge_pages, __ATOMIC_RELAXED);
+    bool prefault = __atomic_load_n(&heap_prefault, __ATOMIC_RELAXED);
+    size_t msize;
+    char *map;
+    block_t *block;
+
+    if (size > SIZE_MAX - offset - extra - mmap_page_size)
+    {
+        return NULL;
+    }
+    msize = round_up(size + offset, mmap_page_size);
+    // Populating huge pages has to wait for the advice
+    map = mmap(NULL, msize + extra, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | ((prefault && !huge) ? MAP_POPULATE : 0), -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (extra > 0)
+    {
+        char *start = (char *)round_up((size_t)map + offset, alignment) - offset;
+        if (start > map)
+        {
+            munmap(map, start - map);
+        }
+        if (start < map + extra)
+        {
+            munmap(start + msize, map + extra - start);
+        }
+        map = start;
+    }
+    if (huge)
+    {
+        advise_huge_pages(map, map + msize);
+        if (prefault)
+        {
+            prefault_pages(map, msize);
+        }
+    }
+    block = (block_t *)(map + offset - wsize);
+    block->header = pack(msize, true) | mmapped_mask;
+    __atomic_add_fetch(&mmap_bytes, msize, __ATOMIC_RELAXED);
+    return header_to_payload(block);
+}
+
+/*
+ * mmap_free: unmaps a mapped block. Unless the thresholds were set through
+ *            mm_mallopt, the mmap threshold is raised to the size of the
+ *            freed block and the trim threshold to twice that.
+ */
+static void mmap_free(block_t *block)
+{
+    size_t msize = get_size(block);
+    size_t size = msize - dsize;
+
+    munmap(mmap_start(block), msize);
+    __atomic_sub_fetch(&mmap_bytes, msize, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&mmap_threshold_dynamic, __ATOMIC_RELAXED)
+        && size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)
+        && size <= mmap_threshold_max)
+    {
+        __atomic_store_n(&mmap_threshold, size, __ATOMIC_RELAXED);
+        __atomic_store_n(&trim_threshold, 2 * size, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * mmap_realloc: resizes a mapped block to hold size bytes with mremap,
+ *               which may move it. Returns NULL, leaving the block
+ *               untouched, on failure.
+ */
+static void *mmap_realloc(block_t *block, size_t size)
+{
+    size_t msize, old_msize;
+    size_t offset = (char *)block - mmap_start(block);
+    char *map;
+
+    if (size > SIZE_MAX - offset - wsize - mmap_page_size)
+    {
+        return NULL;
+    }
+    msize = round_up(size + offset + wsize, mmap_page_size);
+    old_msize = get_size(block);
+    map = mremap(mmap_start(block), old_msize, msize, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    // Wraps around as intended when shrinking
+    __atomic_add_fetch(&mmap_bytes, msize - old_msize, __ATOMIC_RELAXED);
+    block = (block_t *)(map + offset);
+    block->header = pack(msize, true) | mmapped_mask;
+    return header_to_payload(block);
+}
+
+/*
+ * mmap_start: returns the start of the mapping of a mapped block.
+ */
+static char *mmap_start(block_t *block)
+{
+    return (char *)((uintptr_t)block & ~(uintptr_t)(mmap_page_size - 1));
+}
+
+/*
+ * is_slab: returns true if bp lies in the slab region.
+ */
+static bool is_slab(void *bp)
+{
+    return (char *)bp >= slab_base && (char *)bp < slab_end;
+}
+
+/*
+ * slab_of: returns the header of the slab holding object bp.
+ */
+static slab_t *slab_of(void *bp)
+{
+    return (slab_t *)((uintptr_t)bp & ~(uintptr_t)(slab_size - 1));
+}
+
+/*
+ * slab_class: returns the slab class for a request of 1 to slab_max_size
+ *             bytes; class c holds objects of (c + 1) * 16 bytes.
+ */
+static int slab_class(size_t size)
+{
+    return (int)((size - 1) >> ALIGNMENT_LOG2);
+}
+
+/*
+ * slab_malloc: hands out an object of class cls from the first slab of a
+ *              with a free object, creating a slab if there is none. A slab
+ *              that becomes full leaves the list. Requires a's lock.
+ *              Returns NULL if the slab region is exhausted.
+ */
+static void *slab_malloc(arena_t *a, int cls)
+{
+    slab_t *slab = a->slabs[cls];
+    void *bp;
+
+    if (slab == NULL)
+    {
+        slab = slab_create(a, cls);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    if (slab->free != NULL)
+    {
+        bp = slab->free;
+        slab->free = *(void **)bp;
+    }
+    else
+    {
+        bp = slab->bump;
+        slab->bump += slab->size;
+    }
+    slab->used++;
+    if (slab->used == slab->capacity)
+    {
+        slab_unlink(a, slab);
+    }
+    return bp;
+}
+
+/*
+ * slab_free: puts object bp back on its slab. A full slab rejoins a's list;
+ *            an empty one is given back to the slab region unless it is the
+ *            only slab of its class left on the list. Requires a's lock.
+ */
+static void slab_free(arena_t *a, void *bp)
+{
+    slab_t *slab = slab_of(bp);
+
+    *(void **)bp = slab->free;
+    slab->free = bp;
+    if (slab->used == slab->capacity)
+    {
+        slab->prev = NULL;
+        slab->next = a->slabs[slab->cls];
+        if (slab->next != NULL)
+        {
+            slab->next->prev = slab;
+        }
+        a->slabs[slab->cls] = slab;
+    }
+    slab->used--;
+    if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL))
+    {
+        slab_unlink(a, slab);
+        slab_release(slab);
+    }
+}
+
+/*
+ * slab_create: takes an empty slab from the slab region, sets it up for
+ *              class cls and puts it on a's list. Returns NULL if the
+ *              region is exhausted. Requires a's lock.
+ */
+static slab_t *slab_create(arena_t *a, int cls)
+{
+    slab_t *slab;
+    size_t header_size = round_up(sizeof(slab_t), dsize);
+
+    pthread_mutex_lock(&slab_lock);
+    slab = slab_free_pages;
+    if (slab != NULL)
+    {
+        slab_free_pages = slab->next;
+    }
+    else if (slab_brk != NULL && (size_t)(slab_end - slab_brk) >= slab_size)
+    {
+        slab = (slab_t *)slab_brk;
+        slab_brk += slab_size;
+    }
+    pthread_mutex_unlock(&slab_lock);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+
+    slab->arena = a;
+    slab->free = NULL;
+    slab->bump = (char *)slab + header_size;
+    slab->size = (cls + 1) << ALIGNMENT_LOG2;
+    slab->used = 0;
+    slab->capacity = (slab_size - header_size) / slab->size;
+    slab->cls = cls;
+    slab->prev = NULL;
+    slab->next = a->slabs[cls];
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab;
+    }
+    a->slabs[cls] = slab;
+    return slab;
+}
+
+/*
+ * slab_unlink: removes a slab from a's list of slabs with free objects.
+ */
+static void slab_unlink(arena_t *a, slab_t *slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        a->slabs[slab->cls] = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/*
+ * slab_release: gives an empty slab back to the slab region for reuse by
+ *               any arena and class.
+ */
+static void slab_release(slab_t *slab)
+{
+    pthread_mutex_lock(&slab_lock);
+    slab->next = slab_free_pages;
+    slab_free_pages = slab;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * tcache_get: pops an object of the given bin from the calling thread's
+ *             cache. Returns NULL if the bin is empty.
+ */
+static void *tcache_get(int bin)
+{
+    void *bp;
+
+    tcache_check_generation();
+    bp = tcache.bins[bin];
+    if (bp == NULL)
+    {
+        return NULL;
+    }
+    tcache.bins[bin] = *(void **)bp;
+    tcache.counts[bin]--;
+    return bp;
+}
+
+/*
+ * tcache_fill: allocates tcache_fill_count objects for bin from arena a,
+ *              returns one and caches the rest. Placing them back to back
+ *              out of the same free block or slab keeps a thread's objects
+ *              close. Requires a's lock.
+ */
+static void *tcache_fill(arena_t *a, int bin, size_t asize)
+{
+    void *bp = bin_malloc(a, bin, asize);
+
+    if (bp == NULL)
+    {
+        return NULL;
+    }
+    tcache_check_generation();
+    for (unsigned int i = 1; i < tcache_fill_count; i++)
+    {
+        void *extra = bin_malloc(a, bin, asize);
+        if (extra == NULL)
+        {
+            break;
+        }
+        *(void **)extra = tcache.bins[bin];
+        tcache.bins[bin] = extra;
+        tcache.counts[bin]++;
+    }
+    if (tcache.counts[bin] > 0)
+    {
+        tcache_register();
+    }
+    return bp;
+}
+
+/*
+ * tcache_put: caches an allocated object in bin of the calling thread's
+ *             cache. If the bin is full, the older half of it is first
+ *             returned to the arenas owning those objects.
+ */
+static void tcache_put(void *bp, int bin)
+{
+    tcache_check_generation();
+    tcache_register();
+    if (tcache.counts[bin] >= tcache_count_max)
+    {
+        void *keep = tcache.bins[bin];
+        void *flush;
+        for (unsigned int i = 1; i < tcache_count_max / 2; i++)
+        {
+            keep = *(void **)keep;
+        }
+        flush = *(void **)keep;
+        *(void **)keep = NULL;
+        tcache.counts[bin] = tcache_count_max / 2;
+        tcache_flush(flush);
+    }
+    *(void **)bp = tcache.bins[bin];
+    tcache.bins[bin] = bp;
+    tcache.counts[bin]++;
+}
+
+/*
+ * tcache_flush: frees a list of cached objects, which may belong to several
+ *               arenas. Objects of the thread's own arena are freed under a
+ *               single acquisition of its lock; each run of objects of
+ *               another arena is queued for it with a single remote_push.
+ */
+static void tcache_flush(void *bp)
+{
+    arena_t *locked = NULL;
+
+    while (bp != NULL)
+    {
+        void *next = *(void **)bp;
+        arena_t *a = owner_arena(bp);
+        if (a != tcache.arena)
+        {
+            void *last = bp;
+            while (next != NULL && owner_arena(next) == a)
+            {
+                last = next;
+                next = *(void **)next;
+            }
+            remote_push(a, bp, last);
+            bp = next;
+            continue;
+        }
+        if (locked == NULL)
+        {
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            locked = a;
+        }
+        arena_free(a, bp);
+        bp = next;
+    }
+    if (locked != NULL)
+    {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/*
+ * tcache_check_generation: empties the calling thread's cache if it was
+ *                          filled before the heap was last re-initialized;
+ *                          those blocks no longer exist.
+ */
+static void tcache_check_generation(void)
+{
+    if (tcache.generation != heap_generation)
+    {
+        memset(tcache.bins, 0, sizeof(tcache.bins));
+        memset(tcache.counts, 0, sizeof(tcache.counts));
+        tcache.arena = NULL;
+        tcache.generation = heap_generation;
+    }
+}
+
+/*
+ * tcache_register: arranges for the calling thread's cache to be flushed
+ *                  when the thread exits, and links it in stats_threads,
+ *                  the first time it caches a block or counts an operation.
+ */
+static void tcache_register(void)
+{
+    if (!tcache.registered)
+    {
+        pthread_once(&tcache_key_once, tcache_create_key);
+        pthread_setspecific(tcache_key, &tcache);
+        pthread_mutex_lock(&stats_lock);
+        tcache.prev = NULL;
+        tcache.next = stats_threads;
+        if (stats_threads != NULL)
+        {
+            stats_threads->prev = &tcache;
+        }
+        stats_threads = &tcache;
+        pthread_mutex_unlock(&stats_lock);
+        tcache.registered = true;
+    }
+}
+
+/*
+ * tcache_create_key: creates the key whose destructor flushes thread caches.
+ */
+static void tcache_create_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+/*
+ * tcache_thread_exit: returns every block of an exiting thread's cache to
+ *                     the heap and moves its counters to stats_retired. The
+ *                     last thread of an arena drains its remote frees.
+ *                     Should a later destructor allocate again, the cache
+ *                     is registered anew.
+ */
+static void tcache_thread_exit(void *arg)
+{
+    tcache_t *cache = (tcache_t *)arg;
+
+    if (cache->generation == heap_generation)
+    {
+        for (int bin = 0; bin < TCACHE_BINS; bin++)
+        {
+            tcache_flush(cache->bins[bin]);
+        }
+#if !ARENA_BY_CPU
+        arena_t *a = cache->arena;
+        if (a != NULL && __atomic_sub_fetch(&a->threads, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            // Later pushes are drained by their pushers
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            pthread_mutex_unlock(&a->lock);
+        }
+#endif
+    }
+    cache->arena = NULL;
+    memset(cache->bins, 0, sizeof(cache->bins));
+    memset(cache->counts, 0, sizeof(cache->counts));
+
+    pthread_mutex_lock(&stats_lock);
+    stats_retired.nmalloc += cache->stats.nmalloc;
+    stats_retired.nfree += cache->stats.nfree;
+    stats_retired.allocated += cache->stats.allocated;
+    stats_retired.freed += cache->stats.freed;
+#if LATENCY_HIST
+    for (int op = 0; op < MM_LAT_OPS; op++)
+    {
+        for (int b = 0; b < MM_LAT_BUCKETS; b++)
+        {
+            stats_retired.latency[op][b] += cache->stats.latency[op][b];
+        }
+    }
+#endif
+    if (cache->prev != NULL)
+    {
+        cache->prev->next = cache->next;
+    }
+    else
+    {
+        stats_threads = cache->next;
+    }
+    if (cache->next != NULL)
+    {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    cache->registered = false;
+}
+
+/*
+ * stats_count: adds to the calling thread's counters. Only the thread
+ *              itself writes them, mm_stats reads them concurrently; a
+ *              relaxed store is as cheap as a plain one.
+ */
+static void stats_count(size_t allocated, size_t freed, uint64_t nmalloc, uint64_t nfree)
+{
+    thread_stats_t *counts = &tcache.stats;
+
+    tcache_register();
+    __atomic_store_n(&counts->nmalloc, counts->nmalloc + nmalloc, __ATOMIC_RELAXED);
+    __atomic_store_n(&counts->nfree, counts->nfree + nfree, __ATOMIC_RELAXED);
+    __atomic_store_n(&counts->allocated, counts->allocated + allocated, __ATOMIC_RELAXED);
+    __atomic_store_n(&counts->freed, counts->freed + freed, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_sum: adds the counters of one thread to stats. A thread may free
+ *            more than it allocated; only the sum over threads is
+ *            meaningful, which unsigned wrap around keeps right.
+ *            Requires stats_lock.
+ */
+static void stats_sum(mm_stats_t *stats, thread_stats_t *counts)
+{
+    stats->nmalloc += __atomic_load_n(&counts->nmalloc, __ATOMIC_RELAXED);
+    stats->nfree += __atomic_load_n(&counts->nfree, __ATOMIC_RELAXED);
+    stats->allocated += __atomic_load_n(&counts->allocated, __ATOMIC_RELAXED);
+    stats->allocated -= __atomic_load_n(&counts->freed, __ATOMIC_RELAXED);
+}
+
+/*
+ * arena_stats: adds the heap size, event counters, free blocks, fast bins
+ *              and queued remote frees of a to stats. The remote stack is
+ *              only emptied under a's lock and pushers only prepend to it,
+ *              so it can be walked from the head loaded here. Requires
+ *              a's lock.
+ */
+static void arena_stats(arena_t *a, mm_stats_t *stats)
+{
+    block_t *block;
+
+    stats->heap_size += (char *)a->epilogue + wsize - (char *)a->prologue;
+    stats->fast_bytes += a->fast_bytes;
+    for (void *bp = __atomic_load_n(&a->remote_free, __ATOMIC_ACQUIRE); bp != NULL;
+         bp = *(void **)bp)
+    {
+        stats->remote_bytes += usable_size(bp);
+    }
+    stats->extend_heap += a->nextend;
+    stats->splits += a->nsplit;
+    for (int i = 0; i < 4; i++)
+    {
+        stats->coalesce[i] += a->ncoalesce[i];
+    }
+    for (int index = 0; index < NUM_LISTS; index++)
+    {
+        for (block = a->free_list[index]; block != NULL;
+             block = (block_t *)(((word_t *)block->payload)[1]))
+        {
+            stats_block(stats, block);
+        }
+    }
+    for (block = tree_find(a, 0, true); block != NULL; block = tree_next(block))
+    {
+        stats_block(stats, block);
+    }
+}
+
+/*
+ * stats_block: counts a free block in stats.
+ */
+static void stats_block(mm_stats_t *stats, block_t *block)
+{
+    size_t size = get_size(block);
+    int bucket = fls_size(size);
+
+    stats->free_bytes += size;
+    stats->free_blocks++;
+    stats->bucket_blocks[bucket]++;
+    stats->bucket_bytes[bucket] += size;
+    if (size > stats->largest_free)
+    {
+        stats->largest_free = size;
+    }
+}
+
+/*
+ * latency_quantile: returns the upper bound, in cycles, of the bucket by
+ *                   which a fraction q of the total calls counted in
+ *                   buckets had completed.
+ */
+static uint64_t latency_quantile(const uint64_t *buckets, uint64_t total, double q)
+{
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    int b;
+
+    rank = (rank < 1) ? 1 : rank;
+    for (b = 0; b < MM_LAT_BUCKETS - 1; b++)
+    {
+        seen += buckets[b];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+    return (b + 1 < 64) ? (uint64_t)1 << (b + 1) : UINT64_MAX;
+}
+
+#if LATENCY_HIST
+/*
+ * latency_now: reads the cycle counter.
+ */
+static uint64_t latency_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * latency_end: counts the cycles since scope was entered in the calling
+ *              thread's histogram of its op; run as the scope is left.
+ */
+static void latency_end(latency_scope_t *scope)
+{
+    uint64_t cycles = latency_now() - scope->start;
+    int b = (cycles > 1) ? 63 - __builtin_clzll(cycles) : 0;
+    uint64_t *count = &tcache.stats.latency[scope->op][b];
+
+    tcache_register();
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * latency_sum: adds the histograms of one thread to latency. Requires
+ *              stats_lock.
+ */
+static void latency_sum(mm_latency_t *latency, thread_stats_t *counts)
+{
+    for (int op = 0; op < MM_LAT_OPS; op++)
+    {
+        for (int b = 0; b < MM_LAT_BUCKETS; b++)
+        {
+            latency->buckets[op][b] += __atomic_load_n(&counts->latency[op][b], __ATOMIC_RELAXED);
+        }
+    }
+}
+#endif /* LATENCY_HIST */
+
+/*
+ * prof_tick: counts size bytes allocated by the calling thread towards the
+ *            next sample. Returns true if this allocation is sampled. The
+ *            first allocation of a thread only draws its first interval.
+ */
+static bool prof_tick(size_t size)
+{
+    if (__atomic_load_n(&prof_sample_bytes, __ATOMIC_RELAXED) == 0)
+    {
+        return false;
+    }
+    tcache.prof_left -= (int64_t)size;
+    if (tcache.prof_left >= 0)
+    {
+        return false;
+    }
+    bool first = (tcache.prof_seed == 0);
+    if (first)
+    {
+        tcache.prof_seed = ((uint64_t)(uintptr_t)&tcache ^ now_ms()) * 0x9E3779B97F4A7C15ULL | 1;
+    }
+    tcache.prof_left = prof_interval();
+    return !first && !tcache.prof_busy;
+}
+
+/*
+ * prof_interval: draws the number of bytes to the next sample of the
+ *                calling thread from an exponential distribution whose
+ *                mean is prof_sample_bytes (xorshift64 generator).
+ */
+static int64_t prof_interval(void)
+{
+    size_t mean = __atomic_load_n(&prof_sample_bytes, __ATOMIC_RELAXED);
+    uint64_t x = tcache.prof_seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    tcache.prof_seed = x;
+    // Uniform in (0, 1]
+    double u = (double)((x >> 11) + 1) / (double)((uint64_t)1 << 53);
+    return (int64_t)(-prof_log(u) * mean) + 1;
+}
+
+/*
+ * prof_log: returns the natural logarithm of x > 0, to about 1e-5, without
+ *           needing libm: x = m * 2^e with m in [1, 2), and log m from the
+ *           series of atanh((m - 1) / (m + 1)).
+ */
+static double prof_log(double x)
+{
+    union { double d; uint64_t u; } bits = { .d = x };
+    int e = (int)((bits.u >> 52) & 0x7FF) - 1023;
+
+    bits.u = (bits.u & ~((uint64_t)0x7FF << 52)) | ((uint64_t)1023 << 52);
+    double t = (bits.d - 1) / (bits.d + 1);
+    double t2 = t * t;
+    return e * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0/3 + t2 * (1.0/5 + t2 / 7)));
+}
+
+/*
+ * prof_record: records heap or mapped block bp, allocated for size bytes,
+ *              as a live sample with the backtrace of the caller, and
+ *              marks it sampled. The sample is dropped if the tables are
+ *              full or cannot be mapped.
+ */
+static void prof_record(void *bp, size_t size)
+{
+    void *frames[PROF_MAX_FRAMES];
+    int depth;
+
+    // backtrace may allocate the first time it runs; that is not sampled
+    tcache.prof_busy = true;
+    depth = backtrace(frames, PROF_MAX_FRAMES);
+    tcache.prof_busy = false;
+
+    pthread_mutex_lock(&prof_lock);
+    if (prof_stacks == NULL)
+    {
+        size_t bytes = PROF_STACKS * sizeof(prof_stack_t) + PROF_SAMPLES * sizeof(prof_sample_t);
+        void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map != MAP_FAILED)
+        {
+            prof_samples = map;
+            prof_stacks = (prof_stack_t *)(prof_samples + PROF_SAMPLES);
+        }
+    }
+    // Tables are kept at most 3/4 full, so probes stay short
+    prof_stack_t *stack = NULL;
+    if (prof_stacks != NULL && prof_nsamples < PROF_SAMPLES / 4 * 3)
+    {
+        stack = prof_stack_find(frames, depth);
+    }
+    if (stack != NULL)
+    {
+        size_t i = prof_slot(bp);
+        while (prof_samples[i].bp != NULL)
+        {
+            i = (i + 1) & (PROF_SAMPLES - 1);
+        }
+        prof_samples[i] = (prof_sample_t){ bp, size, stack };
+        prof_nsamples++;
+        stack->inuse_count++;
+        stack->inuse_bytes += size;
+        stack->alloc_count++;
+        stack->alloc_bytes += size;
+        payload_to_header(bp)->header |= sampled_mask;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * prof_free: retires the sample of bp, about to be freed or moved, and
+ *            clears its sampled bit. Entries after it in its probe
+ *            sequence are shifted back, so lookups need no tombstones.
+ */
+static void prof_free(void *bp)
+{
+    payload_to_header(bp)->header &= ~sampled_mask;
+    pthread_mutex_lock(&prof_lock);
+    size_t hole = prof_slot(bp);
+    while (prof_samples[hole].bp != bp)
+    {
+        if (prof_samples[hole].bp == NULL)
+        {
+            // Sampled before mm_init emptied the tables
+            pthread_mutex_unlock(&prof_lock);
+            return;
+        }
+        hole = (hole + 1) & (PROF_SAMPLES - 1);
+    }
+    prof_samples[hole].stack->inuse_count--;
+    prof_samples[hole].stack->inuse_bytes -= prof_samples[hole].size;
+    prof_nsamples--;
+    for (size_t i = (hole + 1) & (PROF_SAMPLES - 1); prof_samples[i].bp != NULL;
+         i = (i + 1) & (PROF_SAMPLES - 1))
+    {
+        // An entry may fill the hole unless its home slot lies after it
+        size_t home = prof_slot(prof_samples[i].bp);
+        if (((i - home) & (PROF_SAMPLES - 1)) >= ((i - hole) & (PROF_SAMPLES - 1)))
+        {
+            prof_samples[hole] = prof_samples[i];
+            hole = i;
+        }
+    }
+    prof_samples[hole].bp = NULL;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * prof_stack_find: returns the entry of the stack of depth frames, adding
+ *                  it if it is new, or NULL if the table is full. Requires
+ *                  prof_lock.
+ */
+static prof_stack_t *prof_stack_find(void **frames, int depth)
+{
+    // FNV-1a over the return addresses; 0 marks unused entries
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int f = 0; f < depth; f++)
+    {
+        hash = (hash ^ (uintptr_t)frames[f]) * 0x100000001b3ULL;
+    }
+    hash |= 1;
+
+    size_t i = hash & (PROF_STACKS - 1);
+    while (prof_stacks[i].hash != 0)
+    {
+        if (prof_stacks[i].hash == hash && prof_stacks[i].depth == depth
+            && memcmp(prof_stacks[i].frames, frames, depth * sizeof(void *)) == 0)
+        {
+            return &prof_stacks[i];
+        }
+        i = (i + 1) & (PROF_STACKS - 1);
+    }
+    if (prof_nstacks >= PROF_STACKS / 4 * 3)
+    {
+        return NULL;
+    }
+    prof_nstacks++;
+    prof_stacks[i].hash = hash;
+    prof_stacks[i].depth = depth;
+    memcpy(prof_stacks[i].frames, frames, depth * sizeof(void *));
+    return &prof_stacks[i];
+}
+
+/*
+ * prof_slot: returns the home slot of bp in the table of live samples.
+ */
+static size_t prof_slot(void *bp)
+{
+    return (size_t)(((uintptr_t)bp >> ALIGNMENT_LOG2) * 0x9E3779B97F4A7C15ULL >> 48)
+           & (PROF_SAMPLES - 1);
+}
+
+/*
+ * is_sampled: returns true if an allocated heap or mapped block is a live
+ *             sample of the heap profiler.
+ */
+static bool is_sampled(block_t *block)
+{
+    return (block->header & sampled_mask) != 0;
+}
+
+/*
+ * prof_write: formats to the buffer of out, writing it out when full.
+ *             Allocates nothing, so it is safe under prof_lock.
+ */
+static void prof_write(prof_out_t *out, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    for (int tries = 0; tries < 2; tries++)
+    {
+        va_start(args, fmt);
+        n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, args);
+        va_end(args);
+        if (n >= 0 && (size_t)n < sizeof(out->buf) - out->len)
+        {
+            out->len += n;
+            return;
+        }
+        prof_flush(out);
+    }
+    out->ok = false;
+}
+
+/*
+ * prof_flush: writes out the buffer of out.
+ */
+static void prof_flush(prof_out_t *out)
+{
+    if (out->len > 0)
+    {
+        out->ok = out->ok && write(out->fd, out->buf, out->len) == (ssize_t)out->len;
+        out->len = 0;
+    }
+}
+
+/*
+ * arena_init: lays out an empty heap in a at start, the two words returned
+ *             by arena_sbrk for prologue footer and epilogue header, and
+ *             extends it by chunksize.
+ */
+static bool arena_init(arena_t *a, word_t *start)
+{
+    memset(a->free_list, 0, sizeof(a->free_list));
+    memset(a->tail, 0, sizeof(a->tail));
+    memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+    memset(a->slabs, 0, sizeof(a->slabs));
+    memset(a->fastbins, 0, sizeof(a->fastbins));
+    memset(a->fit_index, 0, sizeof(a->fit_index));
+    a->fast_bytes = 0;
+    a->fl_bitmap = 0;
+    a->free_blocks = 0;
+    a->nextend = 0;
+    a->nsplit = 0;
+    a->grow = chunksize;
+    memset(a->ncoalesce, 0, sizeof(a->ncoalesce));
+    a->tree_root = NULL;
+    a->remote_free = NULL;
+    a->threads = 0;
+    a->fit_policy = __atomic_load_n(&fit_policy, __ATOMIC_RELAXED);
+    a->tree_index = (a->fit_policy == MM_FIT_FIRST) ? NUM_LISTS : get_index(tree_min_size);
+    a->prologue=(block_t *) start;
+    start[0] = pack(0, true); // Prologue footer
+    start[1] = pack(0, true); // Epilogue header
+    // Heap starts with first block header (epilogue)
+    a->epilogue=(block_t *) &(start[1]);
+    set_previous_allocated(a->epilogue);
+    // Extend the empty heap with a free block of chunksize bytes,
+    // coalesce() puts it on its segregated list
+    if (extend_heap(a, chunksize) == NULL)
+    {
+        return false;
+    }
+    // Published last: the main arena is initialized once this is non NULL
+    __atomic_store_n(&a->heap_listp, (block_t *) &(start[1]), __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * arena_create: maps an arena_reserve aligned region for a new arena, with
+ *               the arena_t at its start and its heap right after it.
+ *               Pages are only backed once the heap grows into them.
+ *               Returns NULL on failure.
+ */
+static arena_t *arena_create(void)
+{
+    char *map = mmap(NULL, 2 * arena_reserve, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    // Trim the mapping down to an aligned arena_reserve bytes
+    char *base = (char *)round_up((size_t)map, arena_reserve);
+    if (base > map)
+    {
+        munmap(map, base - map);
+    }
+    munmap(base + arena_reserve, map + arena_reserve - base);
+
+    arena_t *a = (arena_t *)base;
+    pthread_mutex_init(&a->lock, NULL);
+    a->brk = base + round_up(sizeof(arena_t), dsize);
+    a->end = base + arena_reserve;
+    if (!arena_init(a, arena_sbrk(a, 2*wsize)))
+    {
+        munmap(base, arena_reserve);
+        return NULL;
+    }
+    return a;
+}
+
+/*
+ * thread_arena: returns the arena the calling thread allocates from. A
+ *               thread is given the next arena round-robin on its first
+ *               heap access; the arena is created if it does not exist.
+ *               Uses the main arena if an arena cannot be created.
+ */
+static arena_t *thread_arena(void)
+{
+    int index;
+
+    tcache_check_generation();
+#if ARENA_BY_CPU
+    int cpu = sched_getcpu();
+    index = (cpu < 0) ? 0 : cpu % arena_limit;
+#else
+    if (tcache.arena != NULL)
+    {
+        return tcache.arena;
+    }
+    index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % arena_limit;
+#endif
+
+    arena_t *a = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE);
+    if (a == NULL)
+    {
+        pthread_mutex_lock(&arenas_lock);
+        a = arenas[index];
+        if (a == NULL)
+        {
+            a = arena_create();
+            if (a == NULL)
+            {
+                a = &main_arena;
+            }
+            else
+            {
+                __atomic_store_n(&arenas[index], a, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&arenas_lock);
+    }
+    tcache.arena = a;
+#if !ARENA_BY_CPU
+    // Counted until the thread exits, see remote_push
+    __atomic_add_fetch(&a->threads, 1, __ATOMIC_SEQ_CST);
+    tcache_register();
+#endif
+    return a;
+}
+
+/*
+ * arena_of: returns the arena owning a block: the main arena if the block
+ *           lies in the sbrk heap, otherwise the arena_t at the start of
+ *           the aligned region containing it.
+ */
+static arena_t *arena_of(block_t *block)
+{
+    if ((void *)block >= mem_heap_lo() && (void *)block <= mem_heap_hi())
+    {
+        return &main_arena;
+    }
+    return (arena_t *)((uintptr_t)block & ~(uintptr_t)(arena_reserve - 1));
+}
+
+/*
+ * arena_sbrk: grows the heap of a by size bytes and returns the old top, or
+ *             (void *)-1 if the arena is out of space, like mem_sbrk.
+ */
+static void *arena_sbrk(arena_t *a, size_t size)
+{
+    void *old;
+
+    if (a == &main_arena)
+    {
+        return mem_sbrk(size);
+    }
+    if (size > (size_t)(a->end - a->brk))
+    {
+        return (void *)-1;
+    }
+    old = a->brk;
+    a->brk += size;
+    return old;
+}
+
+/*
+ * arena_contains: returns true if p lies within the heap of a.
+ */
+static bool arena_contains(arena_t *a, void *p)
+{
+    if (a == &main_arena)
+    {
+        return p > mem_heap_lo() && p < mem_heap_hi();
+    }
+    return (char *)p > (char *)a && (char *)p < a->brk;
+}
+
+/*
+ * extend_heap: Extends the heap with the requested number of bytes, and
+ *              recreates epilogue header. Returns a pointer to the result of
+ *              coalescing the newly-created block with previous free block, if
+ *              applicable, or NULL in failure.
+ */
+static block_t *extend_heap(arena_t *a, size_t size) 
+{
+    LATENCY_SCOPE(MM_LAT_EXTEND_HEAP);
+    void *bp;
+    bool epilogue_prev=is_previous_allocated(a->epilogue);
+    // The new memory is zero if the arena gets it fresh from the OS
+    bool zeroed = (a == &main_arena) ? SBRK_ZEROED : PURGE_ADVICE == MADV_DONTNEED;
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+    if ((bp = arena_sbrk(a, size)) == (void *)-1)
+    {
+        return NULL;
+    }
+    a->nextend++;
+    if (__atomic_load_n(&heap_huge_pages, __ATOMIC_RELAXED))
+    {
+        advise_huge_pages(bp, (char *)bp + size);
+    }
+    if (__atomic_load_n(&heap_prefault, __ATOMIC_RELAXED))
+    {
+        prefault_pages(bp, size);
+    }
+    
+    // Initialize free block header/footer 
+    block_t *block = payload_to_header(bp);
+    write_header(block, size, false);
+    write_footer(block, size, false);
+    set_purged(block, true); // Never touched, nothing to purge
+    block_t *block_next = find_next(block);
+    write_header(block_next, 0, true);
+    if(epilogue_prev)
+        {set_previous_allocated(block);   
+	 }
+
+    a->epilogue=block_next;
+    set_previous_free(a->epilogue);
+    // Coalesce in case the previous block was free
+    if (!epilogue_prev)
+    {
+        zeroed = zeroed && is_zeroed(find_prev(block));
+    }
+    block_t *merged = coalesce(a, block);
+    if (zeroed)
+    {
+        // Clear the old footer and the header that are now inside the
+        // block, unless they are among the first words it keeps dirty
+        if ((char *)block - (char *)merged > (ptrdiff_t)min_block_size)
+        {
+            memset((char *)block - wsize, 0, dsize);
+        }
+        set_zeroed(merged, true);
+    }
+    block = merged;
+    if (!is_purged(block))
+    {
+        // Merged with a dirty block, which may not have been timestamped
+        ((word_t *)block->payload)[2] = now_ms();
+    }
+    return block;
+}
+
+/* Coalesce: Coalesces current block with previous and next blocks if either
+ *           or both are unallocated; otherwise the block is not modified.
+ *           Returns pointer to the coalesced block. After coalescing, the
+ *           immediate contiguous previous and next blocks must be allocated.
+ */
+static block_t *coalesce(arena_t *a, block_t * block) 
+{ 
+    LATENCY_SCOPE(MM_LAT_COALESCE);
+    block_t *block_next = find_next(block);
+    block_t * block_prev=NULL;
+    bool prev_alloc = is_previous_allocated(block);
+    bool next_alloc = get_alloc(block_next);
+    size_t size = get_size(block);
+    // The result is purged only if all of its parts were
+    bool purged = is_purged(block);
+ 
+    if (prev_alloc && next_alloc)              // Case 1
+    {   a->ncoalesce[0]++;
+        enqueue(a, block,get_index(get_size(block)));
+        set_previous_free(block_next);
+        return block;
+    }
+
+    else if (prev_alloc && !next_alloc)        // Case 2
+    { 
+        a->ncoalesce[1]++;
+        dequeue(a, block_next,get_index(get_size(block_next)));
+        purged = purged && is_purged(block_next);
+        size += get_size(block_next);
+        write_header(block, size, false);
+        write_footer(block, size, false);
+        set_purged(block, purged);
+        enqueue(a, block,get_index(size));
+    }
+
+    else if (!prev_alloc && next_alloc)        // Case 3
+    {  
+        a->ncoalesce[2]++;
+        block_prev=find_prev(block);
+	    dequeue(a, block_prev,get_index(get_size(block_prev)));
+        purged = purged && is_purged(block_prev);
+        size += get_size(block_prev);
+        write_header(block_prev, size, false);
+        write_footer(block_prev, size, false);
+        block = block_prev;
+        set_purged(block, purged);
+        enqueue(a, block,get_index(size));
+        set_previous_free(block_next);
+    }
+
+    else                                        // Case 4
+    {  
+        a->ncoalesce[3]++;
+        block_prev=find_prev(block);
+        dequeue(a, block_prev,get_index(get_size(block_prev)));
+        dequeue(a, block_next,get_index(get_size(block_next)));
+        purged = purged && is_purged(block_prev) && is_purged(block_next);
+        size += get_size(block_next) + get_size(block_prev);
+        write_header(block_prev, size, false);
+        write_footer(block_prev, size, false);
+        block = block_prev;
+        set_purged(block, purged);
+        enqueue(a, block,get_index(size));
+    }
+
+   return block;
+}
+
+/*
+ * place: Places block with size of asize at the start of bp. If the remaining
+ *        size is at least the minimum block size, then split the block to the
+ *        the allocated block and the remaining block as free, which is then
+ *        inserted into the segregated list. Requires that the block is
+ *        initially unallocated.
+ */
+static void place(arena_t *a, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    bool purged = is_purged(block);
+    bool zeroed = is_zeroed(block);
+    word_t dirtied = ((word_t *)block->payload)[2];
+
+    // Unlink first, the split may overwrite the block's links
+    dequeue(a, block,get_index(csize));
+    if ((csize - asize) >= min_block_size)
+    {  
+        block_t *block_next;
+        a->nsplit++;
+        write_header(block, asize, true);
+        write_footer(block, asize, true);
+        block_next = find_next(block);
+        write_header(block_next, csize-asize, false);
+        write_footer(block_next, csize-asize, false);
+        set_previous_allocated(block_next);
+        set_purged(block_next, purged);
+        set_zeroed(block_next, zeroed);
+        if (!purged && csize-asize >= mmap_page_size)
+        {
+            ((word_t *)block_next->payload)[2] = dirtied;
+        }
+        enqueue(a, block_next,get_index(csize-asize));
+    }
+
+    else
+    {   block_t *block_next;
+        block_next = find_next(block);
+        write_header(block, csize, true);
+        write_footer(block, csize, true);
+        set_previous_allocated(block_next);       
+    }
+}
+
+/*
+ * find_fit: Looks for a free block with at least asize bytes. The request
+ * is rounded up to the next class boundary so that every block on a list
+ * at or above that class fits; the first such non empty list is found from
+ * the bitmaps and its a->tail taken. Only when no larger class has a block is
+ * asize's own class searched with first-fit policy(Traversing the list from
+ * the a->tail to head), so small heaps do not grow needlessly. Under a best
+ * fit policy sizes kept in the tree are looked up there, after the lists.
+ * Returns NULL if none is found.
+ */
+static block_t *find_fit(arena_t *a, size_t asize,int index)
+{
+    LATENCY_SCOPE(MM_LAT_FIND_FIT);
+    block_t *block;
+    size_t search_size = asize;
+    int search_index;
+    bool lowest = (a->fit_policy == MM_FIT_ADDRESS_BEST);
+
+    if (index >= a->tree_index)
+    {
+        return tree_find(a, asize, lowest);
+    }
+
+    if (asize >= small_block_size)
+    {
+        search_size += ((size_t)1 << (fls_size(asize) - SL_INDEX_COUNT_LOG2)) - 1;
+    }
+    search_index = find_nonempty_list(a, get_index(search_size));
+    if (search_index >= 0)
+    {
+        block = a->tail[search_index];
+        // Only the last class is open ended and may hold smaller blocks
+        if (asize <= get_size(block))
+        {
+            return block;
+        }
+    }
+
+    if (fit_indexed(a, index) && !a->fit_index[index].lost)
+    {
+        block = fit_index_find(&a->fit_index[index], asize);
+        if (block != NULL)
+        {
+            return block;
+        }
+    }
+    else
+    {
+        for (block = a->tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[0]))
+        {
+            if (asize <= get_size(block))
+            {
+                return block;
+            }
+        }
+    }
+    if (a->tree_root != NULL)
+    {
+        return tree_find(a, asize, lowest);
+    }
+    return NULL; // no fit found
+}
+
+/*
+ * find_nonempty_list: returns the first non empty list at or above index,
+ * using the second level bitmap of index's first level and, failing that,
+ * the first level bitmap. Returns -1 if every such list is empty.
+ */
+static int find_nonempty_list(arena_t *a, int index)
+{
+    int fl = index / SL_INDEX_COUNT;
+    int sl = index % SL_INDEX_COUNT;
+    uint32_t sl_map = a->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+
+    if (sl_map == 0)
+    {
+        uint64_t fl_map = a->fl_bitmap & (~(uint64_t)0 << (fl + 1));
+        if (fl_map == 0)
+        {
+            return -1;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = a->sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return fl * SL_INDEX_COUNT + sl;
+}
+
+/*Enqueue is used to add block to the segregated lists
+ *It takes index number as an input to decide which segregated
+ *list to add it to. Lists from a->tree_index on go to the tree.
+ */
+static void enqueue(arena_t *a, block_t * block,int index){
+      
+      if(block==NULL)
+         return;
+      
+      if(index>=a->tree_index){
+        tree_insert(a, block);
+        a->free_blocks++;
+        return;
+      }
+
+      word_t *ptr=(word_t *) block->payload;
+      
+      if(a->free_list[index]==NULL){
+        a->free_list[index]=block;
+        a->tail[index]=block;
+        ptr[1]=0;
+        ptr[0]=0;
+        a->sl_bitmap[index/SL_INDEX_COUNT]|=(uint32_t)1<<(index%SL_INDEX_COUNT);
+        a->fl_bitmap|=(uint64_t)1<<(index/SL_INDEX_COUNT);
+     }
+
+ else{
+      ptr[1]=(word_t)a->free_list[index];
+      ptr[0]=0;
+      ptr=(word_t *)a->free_list[index]->payload;
+      ptr[0]=(word_t)block;
+      a->free_list[index]=block;
+      }
+
+    if(fit_indexed(a, index))
+        fit_index_add(a, block, index);
+    a->free_blocks++;
+  return ;
+}
+/*Dequeue is used to remove block from the segregated lists
+ *It takes index number as an input to decide which segregated
+ *list to remove from. The index is that of the size the block
+ *was enqueued with, its header may already be rewritten.
+ */
+
+static void dequeue(arena_t *a, block_t * block,int index){
+ 
+    block_t * previous=NULL,*next=NULL;  
+    if(block==NULL)
+        return;   
+
+    if(index>=a->tree_index){
+        tree_remove(a, block);
+        a->free_blocks--;
+        return;
+    }
+   
+    if(fit_indexed(a, index))
+        fit_index_remove(a, block, index);
+    previous=(block_t *)(((word_t *)block->payload)[0]);
+    next=(block_t *)(((word_t *)block->payload)[1]);
+
+    if(previous==NULL&&next==NULL){
+        ((word_t *)block->payload)[0]=0;
+        ((word_t *)block->payload)[1]=0;
+        a->free_list[index]=NULL;
+        a->tail[index]=NULL;
+        a->sl_bitmap[index/SL_INDEX_COUNT]&=~((uint32_t)1<<(index%SL_INDEX_COUNT));
+        if(a->sl_bitmap[index/SL_INDEX_COUNT]==0)
+            a->fl_bitmap&=~((uint64_t)1<<(index/SL_INDEX_COUNT));
+
+    }
+
+    if(previous==NULL&&next!=NULL){
+         ((word_t *)block->payload)[0]=0;
+         ((word_t *)block->payload)[1]=0;
+         ((word_t *)next->payload)[0]=0;
+         a->free_list[index]=next; 
+    }
+
+    if(previous!=NULL&&next==NULL){
+         a->tail[index]=(block_t*)(((word_t *)block->payload)[0]);
+         ((word_t *)block->payload)[0]=0;
+         ((word_t *)block->payload)[1]=0;
+         ((word_t *)previous->payload)[1]=0;
+
+    }
+    if(previous!=NULL&&next!=NULL){
+         ((word_t *)block->payload)[0]=0;
+         ((word_t *)block->payload)[1]=0;
+         ((word_t *)next->payload)[0]=(word_t)previous;
+         ((word_t *)previous->payload)[1]=(word_t)next;
+
+    }
+ a->free_blocks--;
+return;
+
+}
+
+/*
+ * fit_indexed: returns true if list index of a is mirrored in its fit
+ *              index: a list of a range of sizes that is not in the tree.
+ */
+static bool fit_indexed(arena_t *a, int index)
+{
+    return index >= (int)(small_block_size >> ALIGNMENT_LOG2) && index < a->tree_index;
+}
+
+/*
+ * fit_index_add: appends free block block to the fit index of its list
+ *                index, recording its slot in the block. Requires a's lock.
+ */
+static void fit_index_add(arena_t *a, block_t *block, int index)
+{
+    fit_index_t *fit = &a->fit_index[index];
+
+    if (fit->lost)
+    {
+        return;
+    }
+    if (fit->count == fit->capacity && !fit_index_grow(fit))
+    {
+        fit->lost = true;
+        return;
+    }
+    fit->sizes[fit->count] = get_size(block);
+    fit->blocks[fit->count] = block;
+    ((word_t *)block->payload)[3] = fit->count++;
+}
+
+/*
+ * fit_index_remove: removes free block block from the fit index of its
+ *                   list index, moving the last entry into its slot. A lost
+ *                   index starts over once its list empties. Requires a's
+ *                   lock.
+ */
+static void fit_index_remove(arena_t *a, block_t *block, int index)
+{
+    fit_index_t *fit = &a->fit_index[index];
+
+    if (fit->lost)
+    {
+        // The list empties once block, its last block, is unlinked
+        if (a->free_list[index] == block && a->tail[index] == block)
+        {
+            fit->count = 0;
+            fit->lost = false;
+        }
+        return;
+    }
+    uint32_t slot = (uint32_t)((word_t *)block->payload)[3];
+    dbg_assert(slot < fit->count && fit->blocks[slot] == block);
+    uint32_t last = --fit->count;
+    if (slot != last)
+    {
+        fit->sizes[slot] = fit->sizes[last];
+        fit->blocks[slot] = fit->blocks[last];
+        ((word_t *)fit->blocks[slot]->payload)[3] = slot;
+    }
+}
+
+/*
+ * fit_index_find: returns a block of at least asize bytes from fit, or NULL.
+ *                 Only the sizes array is read until a block is chosen.
+ */
+static block_t *fit_index_find(fit_index_t *fit, size_t asize)
+{
+    size_t *sizes = fit->sizes;
+    uint32_t count = fit->count;
+    uint32_t i = 0;
+
+    // Four compares per step, which the compiler can do in SIMD registers
+    while (i + 4 <= count
+           && ((sizes[i] < asize) & (sizes[i + 1] < asize)
+               & (sizes[i + 2] < asize) & (sizes[i + 3] < asize)))
+    {
+        i += 4;
+    }
+    for (; i < count; i++)
+    {
+        if (sizes[i] >= asize)
+        {
+            return fit->blocks[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * fit_index_grow: doubles the arrays of fit, mapping fit_index_initial
+ *                 entries the first time. Returns false if out of memory.
+ */
+static bool fit_index_grow(fit_index_t *fit)
+{
+    uint32_t capacity = (fit->capacity == 0) ? fit_index_initial : 2 * fit->capacity;
+    size_t bytes = (size_t)capacity * (sizeof(size_t) + sizeof(block_t *));
+    char *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (capacity < fit->capacity || map == MAP_FAILED)
+    {
+        return false;
+    }
+    size_t *sizes = (size_t *)map;
+    block_t **blocks = (block_t **)(map + (size_t)capacity * sizeof(size_t));
+    if (fit->capacity > 0)
+    {
+        memcpy(sizes, fit->sizes, fit->count * sizeof(size_t));
+        memcpy(blocks, fit->blocks, fit->count * sizeof(block_t *));
+        munmap(fit->sizes, (size_t)fit->capacity * (sizeof(size_t) + sizeof(block_t *)));
+    }
+    fit->sizes = sizes;
+    fit->blocks = blocks;
+    fit->capacity = capacity;
+    return true;
+}
+
+/*
+ * fit_index_release: unmaps the fit index arrays of a, before its heap is
+ *                    thrown away by mm_init.
+ */
+static void fit_index_release(arena_t *a)
+{
+    for (int i = 0; i < NUM_LISTS; i++)
+    {
+        fit_index_t *fit = &a->fit_index[i];
+        if (fit->capacity > 0)
+        {
+            munmap(fit->sizes, (size_t)fit->capacity * (sizeof(size_t) + sizeof(block_t *)));
+        }
+    }
+    memset(a->fit_index, 0, sizeof(a->fit_index));
+}
+
+/*
+ * tree_insert: adds a free block to the tree of a and rebalances it.
+ */
+static void tree_insert(arena_t *a, block_t *block)
+{
+    block_t *parent = NULL;
+    block_t **link = &a->tree_root;
+
+    while (*link != NULL)
+    {
+        parent = *link;
+        link = tree_child(parent, tree_less(parent, block));
+    }
+    *tree_child(block, 0) = NULL;
+    *tree_child(block, 1) = NULL;
+    tree_set_parent(block, parent);
+    tree_set_red(block, true);
+    *link = block;
+
+    // Fix a red node under a red parent, moving up the tree
+    while ((parent = tree_parent(block)) != NULL && tree_is_red(parent))
+    {
+        block_t *grand = tree_parent(parent);
+        int dir = (parent == *tree_child(grand, 0)) ? 0 : 1;
+        block_t *uncle = *tree_child(grand, !dir);
+
+        if (tree_is_red(uncle))
+        {
+            tree_set_red(parent, false);
+            tree_set_red(uncle, false);
+            tree_set_red(grand, true);
+            block = grand;
+            continue;
+        }
+        if (block == *tree_child(parent, !dir))
+        {
+            block = parent;
+            tree_rotate(a, block, dir);
+            parent = tree_parent(block);
+        }
+        tree_set_red(parent, false);
+        tree_set_red(grand, true);
+        tree_rotate(a, grand, !dir);
+    }
+    tree_set_red(a->tree_root, false);
+}
+
+/*
+ * tree_remove: unlinks a free block from the tree of a and rebalances it.
+ *              Keys are not compared, so the block's header may already
+ *              hold a new size.
+ */
+static void tree_remove(arena_t *a, block_t *block)
+{
+    block_t *left = *tree_child(block, 0);
+    block_t *right = *tree_child(block, 1);
+    block_t *child, *parent;
+    bool red;
+
+    if (left == NULL || right == NULL)
+    {
+        child = (left != NULL) ? left : right;
+        parent = tree_parent(block);
+        red = tree_is_red(block);
+        tree_replace(a, block, child, parent);
+    }
+    else
+    {
+        // Put the successor, the leftmost node on the right, in its place
+        block_t *next = right;
+        while (*tree_child(next, 0) != NULL)
+        {
+            next = *tree_child(next, 0);
+        }
+        child = *tree_child(next, 1);
+        red = tree_is_red(next);
+        if (next == right)
+        {
+            parent = next;
+        }
+        else
+        {
+            parent = tree_parent(next);
+            *tree_child(parent, 0) = child;
+            if (child != NULL)
+            {
+                tree_set_parent(child, parent);
+            }
+            *tree_child(next, 1) = right;
+            tree_set_parent(right, next);
+        }
+        *tree_child(next, 0) = left;
+        tree_set_parent(left, next);
+        tree_replace(a, block, next, tree_parent(block));
+        tree_set_red(next, tree_is_red(block));
+    }
+    if (red)
+    {
+        return;
+    }
+
+    // A black node was removed: child's side is one black node short
+    while (child != a->tree_root && !tree_is_red(child))
+    {
+        int dir = (child == *tree_child(parent, 0)) ? 0 : 1;
+        block_t *sibling = *tree_child(parent, !dir);
+
+        if (tree_is_red(sibling))
+        {
+            tree_set_red(sibling, false);
+            tree_set_red(parent, true);
+            tree_rotate(a, parent, dir);
+            sibling = *tree_child(parent, !dir);
+        }
+        if (!tree_is_red(*tree_child(sibling, 0)) && !tree_is_red(*tree_child(sibling, 1)))
+        {
+            tree_set_red(sibling, true);
+            child = parent;
+            parent = tree_parent(child);
+            continue;
+        }
+        if (!tree_is_red(*tree_child(sibling, !dir)))
+        {
+            tree_set_red(*tree_child(sibling, dir), false);
+            tree_set_red(sibling, true);
+            tree_rotate(a, sibling, !dir);
+            sibling = *tree_child(parent, !dir);
+        }
+        tree_set_red(sibling, tree_is_red(parent));
+        tree_set_red(parent, false);
+        tree_set_red(*tree_child(sibling, !dir), false);
+        tree_rotate(a, parent, dir);
+        child = a->tree_root;
+    }
+    if (child != NULL)
+    {
+        tree_set_red(child, false);
     }
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
-
-    return bp;
 }
 
-/******** The remaining content below are helper and debug routines ********/
-
 /*
- * extend_heap: Extends the heap with the requested number of bytes, and
- *              recreates epilogue header. Returns a pointer to the result of
- *              coalescing the newly-created block with previous free block, if
- *              applicable, or NULL in failure.
+ * tree_find: returns the smallest free block in the tree of a with at
+ *            least asize bytes; with lowest set, the one with the lowest
+ *            address among blocks of that size. Returns NULL if none fits.
  */
-static block_t *extend_heap(size_t size) 
+static block_t *tree_find(arena_t *a, size_t asize, bool lowest)
 {
-    void *bp;
-    bool epilogue_prev=is_previous_allocated(epilogue);
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1)
+    block_t *block = a->tree_root;
+    block_t *best = NULL;
+
+    while (block != NULL)
     {
-        return NULL;
+        size_t size = get_size(block);
+        if (size < asize)
+        {
+            block = *tree_child(block, 1);
+            continue;
+        }
+        best = block;
+        if (size == asize && !lowest)
+        {
+            break;
+        }
+        block = *tree_child(block, 0);
     }
-    
-    // Initialize free block header/footer 
-    block_t *block = payload_to_header(bp);
-    write_header(block, size, false);
-    write_footer(block, size, false);
-    block_t *block_next = find_next(block);
-    write_header(block_next, 0, true);
-    if(epilogue_prev)
-        {set_previous_allocated(block);   
-	 }
-
-    epilogue=block_next;
-    set_previous_free(epilogue);
-    // Coalesce in case the previous block was free
-    return coalesce(block);
+    return best;
 }
 
-/* Coalesce: Coalesces current block with previous and next blocks if either
- *           or both are unallocated; otherwise the block is not modified.
- *           Returns pointer to the coalesced block. After coalescing, the
- *           immediate contiguous previous and next blocks must be allocated.
+/*
+ * tree_next: returns the block following block in tree order, or NULL.
  */
-static block_t *coalesce(block_t * block) 
-{ 
-    block_t *block_next = find_next(block);
-    block_t * block_prev=NULL;
-    bool prev_alloc = is_previous_allocated(block);
-    bool next_alloc = get_alloc(block_next);
-    size_t size = get_size(block);
- 
-    if (prev_alloc && next_alloc)              // Case 1
-    {   enqueue(block,get_index(get_size(block)));
-        set_previous_free(block_next);
-        return block;
-    }
-
-    else if (prev_alloc && !next_alloc)        // Case 2
-    { 
-        dequeue(block_next,get_index(get_size(block_next)));
-        size += get_size(block_next);
-        write_header(block, size, false);
-        write_footer(block, size, false);
-        enqueue(block,get_index(size));
-    }
+static block_t *tree_next(block_t *block)
+{
+    block_t *next = *tree_child(block, 1);
 
-    else if (!prev_alloc && next_alloc)        // Case 3
-    {  
-        block_prev=find_prev(block);
-	    dequeue(block_prev,get_index(get_size(block_prev)));
-        size += get_size(block_prev);
-        write_header(block_prev, size, false);
-        write_footer(block_prev, size, false);
-        block = block_prev;
-        enqueue(block,get_index(size));
-        set_previous_free(block_next);
+    if (next != NULL)
+    {
+        while (*tree_child(next, 0) != NULL)
+        {
+            next = *tree_child(next, 0);
+        }
+        return next;
     }
-
-    else                                        // Case 4
-    {  
-        block_prev=find_prev(block);
-        dequeue(block_prev,get_index(get_size(block_prev)));
-        dequeue(block_next,get_index(get_size(block_next)));
-        size += get_size(block_next) + get_size(block_prev);
-        write_header(block_prev, size, false);
-        write_footer(block_prev, size, false);
-        block = block_prev;
-        enqueue(block,get_index(size));
+    next = tree_parent(block);
+    while (next != NULL && block == *tree_child(next, 1))
+    {
+        block = next;
+        next = tree_parent(block);
     }
-
-   return block;
+    return next;
 }
 
 /*
- * place: Places block with size of asize at the start of bp. If the remaining
- *        size is at least the minimum block size, then split the block to the
- *        the allocated block and the remaining block as free, which is then
- *        inserted into the segregated list. Requires that the block is
- *        initially unallocated.
+ * tree_rotate: rotates the subtree at block in direction dir (0 is left):
+ *              its child on the other side takes its place.
  */
-static void place(block_t *block, size_t asize)
+static void tree_rotate(arena_t *a, block_t *block, int dir)
 {
-    size_t csize = get_size(block);
+    block_t *pivot = *tree_child(block, !dir);
+    block_t *inner = *tree_child(pivot, dir);
 
-    if ((csize - asize) >= min_block_size)
-    {  
-        block_t *block_next;
-        write_header(block, asize, true);
-        write_footer(block, asize, true);
-        block_next = find_next(block);
-        dequeue(block,get_index(csize));       
-        write_header(block_next, csize-asize, false);
-        write_footer(block_next, csize-asize, false);
-        set_previous_allocated(block_next);
-        enqueue(block_next,get_index(csize-asize));
+    *tree_child(block, !dir) = inner;
+    if (inner != NULL)
+    {
+        tree_set_parent(inner, block);
     }
+    tree_replace(a, block, pivot, tree_parent(block));
+    *tree_child(pivot, dir) = block;
+    tree_set_parent(block, pivot);
+}
 
+/*
+ * tree_replace: makes block (possibly NULL) the child of parent that old
+ *               was, or the root if parent is NULL.
+ */
+static void tree_replace(arena_t *a, block_t *old, block_t *block, block_t *parent)
+{
+    if (parent == NULL)
+    {
+        a->tree_root = block;
+    }
     else
-    {   block_t *block_next;
-        block_next = find_next(block);
-        write_header(block, csize, true);
-        write_footer(block, csize, true);
-        dequeue(block,get_index(csize));
-        set_previous_allocated(block_next);       
+    {
+        *tree_child(parent, old == *tree_child(parent, 0) ? 0 : 1) = block;
+    }
+    if (block != NULL)
+    {
+        tree_set_parent(block, parent);
     }
 }
 
-/*
- * find_fit: Looks for a free block with at least asize bytes with
- * first-fit policy(Traversing the list from the tail to head)
- * Returns NULL if none is found.
+/*tree_child returns the link to the left (dir 0)
+ * or right (dir 1) child of a tree node
  */
-static block_t *find_fit(size_t asize,int index)
-{
-    block_t *block,*ret_block=NULL;
-
-while(ret_block==NULL&&index<5){
-    if(tail[index]!=NULL)
-      { 
-	for (block = tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[0]))
-           {
-              if (asize <= get_size(block))
-               { 
-	         return block;
-               }  
-        } 
-   }     
-     
- index++;
+static block_t **tree_child(block_t *block, int dir){
 
+return &((block_t **)block->payload)[dir];
 }
 
- return ret_block; // no fit found
-}
-
-/*Enqueue is used to add block to the segregated lists
- *It takes index number as an input to decide which segregated
- *list to add it to.
+/*tree_parent returns the parent of a tree
+ * node, NULL for the root
  */
-static void enqueue(block_t * block,int index){
-      
-      if(block==NULL)
-         return;
-      
-      word_t *ptr=(word_t *) block->payload;
-      
-      if(free_list[index]==NULL){
-        free_list[index]=block;
-        tail[index]=block;
-        ptr[1]=0;
-        ptr[0]=0;
-     }
-
- else{
-      ptr[1]=(word_t)free_list[index];
-      ptr[0]=0;
-      ptr=(word_t *)free_list[index]->payload;
-      ptr[0]=(word_t)block;
-      free_list[index]=block;
-      }
+static block_t *tree_parent(block_t *block){
 
-    free_blocks++;
-  return ;
+return (block_t *)(((word_t *)block->payload)[3]&~tree_red_mask);
 }
-/*Dequeue is used to remove block from the segregated lists
- *It takes index number as an input to decide which segregated
- *list to remove from.
- */
 
-static void dequeue(block_t * block,int index){
- 
-    block_t * previous=NULL,*next=NULL;  
-    if(block==NULL)
-        return;   
-   
-    previous=(block_t *)(((word_t *)block->payload)[0]);
-    next=(block_t *)(((word_t *)block->payload)[1]);
+/*tree_set_parent sets the parent of a tree
+ * node, keeping its colour
+ */
+static void tree_set_parent(block_t *block, block_t *parent){
 
-    if(previous==NULL&&next==NULL){
-        ((word_t *)block->payload)[0]=0;
-        ((word_t *)block->payload)[1]=0;
-        free_list[index]=NULL;
-        tail[index]=NULL;
+word_t *ptr=(word_t *)block->payload;
+ptr[3]=(word_t)parent|(ptr[3]&tree_red_mask);
+}
 
-    }
+/*tree_is_red returns true if a tree node
+ * is red; missing nodes are black
+ */
+static bool tree_is_red(block_t *block){
 
-    if(previous==NULL&&next!=NULL){
-         ((word_t *)block->payload)[0]=0;
-         ((word_t *)block->payload)[1]=0;
-         ((word_t *)next->payload)[0]=0;
-         free_list[index]=next; 
-    }
+return block!=NULL&&(((word_t *)block->payload)[3]&tree_red_mask)!=0;
+}
 
-    if(previous!=NULL&&next==NULL){
-         tail[index]=(block_t*)(((word_t *)block->payload)[0]);
-         ((word_t *)block->payload)[0]=0;
-         ((word_t *)block->payload)[1]=0;
-         ((word_t *)previous->payload)[1]=0;
+/*tree_set_red sets the colour of a tree node
+ */
+static void tree_set_red(block_t *block, bool red){
 
-    }
-    if(previous!=NULL&&next!=NULL){
-         ((word_t *)block->payload)[0]=0;
-         ((word_t *)block->payload)[1]=0;
-         ((word_t *)next->payload)[0]=(word_t)previous;
-         ((word_t *)previous->payload)[1]=(word_t)next;
+word_t *ptr=(word_t *)block->payload;
+if(red)
+ ptr[3]=ptr[3]|tree_red_mask;
+else
+ ptr[3]=ptr[3]&(~tree_red_mask);
+}
 
-    }
- free_blocks--;
-return;
+/*tree_less returns true if block x orders
+ * before y: smaller, or as big at a lower
+ * address
+ */
+static bool tree_less(block_t *x, block_t *y){
 
+if(get_size(x)!=get_size(y))
+ return get_size(x)<get_size(y);
+return x<y;
 }
 
 /*set_previous_allocated sets the previous allocated 
@@ -572,34 +4741,81 @@ if(block->header&prev_alloc_mask)
 return ret;
 }
 
-/* get_index: it is used to calculate
- * the list to which a block should be
- *added. I keep size<32 in index 0,
- * and flocks of size>2^8 in index 4
- * and reamining in the intermediate indexe
- * based on the log value(to the base 2).
+/*is_zeroed returns true if a free block
+ * is zero but for its header, footer and
+ * first four payload words
  */
+static bool is_zeroed(block_t *block){
 
-static int get_index(size_t size)
-{
+return (block->header&zeroed_mask)!=0;
+}
+
+/*set_zeroed sets or clears the zeroed
+ * bit of a free block
+ */
+static void set_zeroed(block_t *block, bool zeroed){
 
-int count=0;
-while(size>1){
-size=size/2;
-count++;
+if(zeroed)
+ block->header=block->header|zeroed_mask;
+else
+ block->header=block->header&(~zeroed_mask);
 }
 
-if (count<=5)
-return 0;
+/*is_purged returns true if the pages
+ * of a free block were released already
+ */
+static bool is_purged(block_t *block){
 
+return (block->header&purged_mask)!=0;
+}
 
-if(count>8)
-return 4;
+/*set_purged sets or clears the purged
+ * bit of a free block
+ */
+static void set_purged(block_t *block, bool purged){
 
+if(purged)
+ block->header=block->header|purged_mask;
 else
-return count-5;
+ block->header=block->header&(~purged_mask);
+}
+
+/* get_index: it is used to calculate
+ * the list to which a block should be
+ * added. Sizes below small_block_size map
+ * to one list per 16 bytes; larger sizes
+ * map to first level log2(size) and second
+ * level the next SL_INDEX_COUNT_LOG2 bits
+ * below the leading one. Sizes beyond
+ * FL_INDEX_MAX share the last list.
+ */
+
+static int get_index(size_t size)
+{
+    int fl, sl, log2;
+
+    if (size < small_block_size)
+    {
+        return (int)(size >> ALIGNMENT_LOG2);
+    }
 
+    log2 = fls_size(size);
+    fl = log2 - FL_INDEX_SHIFT + 1;
+    sl = (int)(size >> (log2 - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+    if (fl >= FL_INDEX_COUNT)
+    {
+        return NUM_LISTS - 1;
+    }
+    return fl * SL_INDEX_COUNT + sl;
+}
 
+/*
+ * fls_size: returns the index of the most significant set bit of a non
+ *           zero size, i.e. floor(log2(size)).
+ */
+static int fls_size(size_t size)
+{
+    return 63 - __builtin_clzll((unsigned long long)size);
 }
 
 
@@ -611,6 +4827,14 @@ static size_t max(size_t x, size_t y)
     return (x > y) ? x : y;
 }
 
+/*
+ * min: returns x if x < y, and y otherwise.
+ */
+static size_t min(size_t x, size_t y)
+{
+    return (x < y) ? x : y;
+}
+
 
 /*
  * round_up: Rounds size up to next multiple of n
@@ -760,15 +4984,32 @@ static void *header_to_payload(block_t *block)
  *               the heap is correct, and false otherwise.
  *               can call this function using mm_checkheap(__LINE__);
  *               to identify the line number of the call site.
+ *               Every arena is checked; the caller must keep other
+ *               threads from modifying them meanwhile.
  */
 bool mm_checkheap(int lineno)  
+{
+    for (int i = 0; i < ARENA_MAX; i++)
+    {
+        if (arenas[i] != NULL && !check_arena(arenas[i], lineno))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* check_arena: checks the heap of arena a for correctness, as described
+ *              for mm_checkheap.
+ */
+static bool check_arena(arena_t *a, int lineno)
 {
  
-  if(heap_listp==NULL)
+  if(a->heap_listp==NULL)
    return true;
   block_t *block=NULL,*next=NULL,*prev=NULL;
   int index=0,blocks_in_list=0,blocks_in_heap=0;
-  block=heap_listp;
+  block=a->heap_listp;
   //int count_traversing_reverse=0;//blocks_in_heap;
   word_t header,footer;
   bool present_alloc,prev_alloc_bit,next_alloc;
@@ -804,8 +5045,8 @@ bool mm_checkheap(int lineno)
 
 //Checking if the blocks are in the valid address range
 
-	if(!(block>=heap_listp&&block<=epilogue)){
-         dbg_printf("\nThe block lies at an invalid address: %p whereas the prologue is %p and epilogue is %p",block,prologue,epilogue);
+	if(!(block>=a->heap_listp&&block<=a->epilogue)){
+         dbg_printf("\nThe block lies at an invalid address: %p whereas the prologue is %p and epilogue is %p",block,a->prologue,a->epilogue);
          return false;
 	 }
 //Checking if the prev_alloc bit is correct in the next block
@@ -826,35 +5067,38 @@ bool mm_checkheap(int lineno)
             dbg_printf("\nThere is a block which is disaligned");
             return false;
         }
-//Checking the prologue and epilogue
-        if(block==epilogue)
+//Checking the a->prologue and a->epilogue
+        if(block==a->epilogue)
           {
             dbg_printf("\nThe size of epilogue is non Zero");
             return false;
           }     
 
-          if(block==prologue)
+          if(block==a->prologue)
           {
             dbg_printf("\nThe size of prologue is non Zero");
             return false;
           }  
 
+      next=find_next(block);
+     block=next;
+    }
 
-    //   Checking for the free_list pointers to be lying 
+    //   Checking for the a->free_list pointers to be lying 
     //     between mem_heap_lo() and mem_heap_high()
-         for(int i=0;i<5;i++){
+         for(int i=0;i<NUM_LISTS;i++){
 
-            if(free_list[i]!=NULL){
-                if(!((void *)free_list[i]>mem_heap_lo()&&(void *)free_list[i]<mem_heap_hi()))
+            if(a->free_list[i]!=NULL){
+                if(!arena_contains(a,a->free_list[i]))
                     {
-                        dbg_printf("The free list pointer is out of heap bounds %p",free_list[i]);
+                        dbg_printf("The free list pointer is out of heap bounds %p",a->free_list[i]);
                         return false;
                     }
               }
-             if(tail[i]!=NULL){    
-                 if(!((void *)tail[i]>mem_heap_lo()&&(void *)tail[i]<mem_heap_hi()))
+             if(a->tail[i]!=NULL){    
+                 if(!arena_contains(a,a->tail[i]))
                     {
-                         dbg_printf("The tail pointer is out of heap bounds %p",tail[i]);
+                         dbg_printf("The a->tail pointer is out of heap bounds %p",a->tail[i]);
                          return false;
                     }   
              
@@ -863,19 +5107,53 @@ bool mm_checkheap(int lineno)
 
         }
 
-      
-      next=find_next(block);
-     block=next;
-    }
+//Checking if the bitmaps agree with the lists being non empty
+     for(int i=0;i<NUM_LISTS;i++){
+        bool list_bit=(a->sl_bitmap[i/SL_INDEX_COUNT]>>(i%SL_INDEX_COUNT))&1;
+        if(list_bit!=(a->free_list[i]!=NULL)){
+            dbg_printf("\nThe bitmap bit of list %d does not match the list",i);
+            return false;
+        }
+        if(((a->fl_bitmap>>(i/SL_INDEX_COUNT))&1)!=(a->sl_bitmap[i/SL_INDEX_COUNT]!=0)){
+            dbg_printf("\nThe first level bitmap is wrong for list %d",i);
+            return false;
+        }
+     }
+
+//Checking that the slabs on the arena's lists belong to it and have room
+     for(int i=0;i<SLAB_CLASSES;i++){
+        for(slab_t *slab=a->slabs[i];slab!=NULL;slab=slab->next){
+            if(slab->arena!=a||slab->cls!=i||slab->used>=slab->capacity||!is_slab(slab)){
+                dbg_printf("\nThe slab at %p on list %d is inconsistent",slab,i);
+                return false;
+            }
+        }
+     }
+
+//Checking that the fast bins hold allocated blocks of their class
+     size_t fast_bytes=0;
+     for(int i=0;i<FASTBIN_COUNT;i++){
+        for(block=a->fastbins[i];block!=NULL;block=*(block_t **)block->payload){
+            if(!arena_contains(a,block)||!get_alloc(block)||get_size(block)!=((size_t)i<<ALIGNMENT_LOG2)){
+                dbg_printf("\nThe block at %p on fast bin %d is inconsistent",block,i);
+                return false;
+            }
+            fast_bytes+=get_size(block);
+        }
+     }
+     if(fast_bytes!=a->fast_bytes){
+        dbg_printf("\nThe fast bins hold %zu bytes, not %zu",fast_bytes,a->fast_bytes);
+        return false;
+     }
 
 //Checking if the number of free blocks in the list match 
 //the number of free blocks in the Heap and if the free 
 //blocks are in the correct list(Bucket). 
      index=0;
-     while(index<5){
-        if(tail[index]!=NULL)
+     while(index<NUM_LISTS){
+        if(a->tail[index]!=NULL)
             { 
-            for (block = tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[0]))
+            for (block = a->tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[0]))
                 {
                     blocks_in_list++;
                     if(get_index(get_size(block))!=index){
@@ -888,6 +5166,32 @@ bool mm_checkheap(int lineno)
       index++;
 
     }   
+//Checking that the fit index mirrors its lists
+     for(index=0;index<NUM_LISTS;index++){
+        fit_index_t *fit=&a->fit_index[index];
+        uint32_t listed=0;
+        if(!fit_indexed(a,index)||fit->lost)
+            continue;
+        for(block=a->tail[index];block!=NULL;block=(block_t *)(((word_t *)block->payload)[0])){
+            word_t slot=((word_t *)block->payload)[3];
+            if(slot>=fit->count||fit->blocks[slot]!=block||fit->sizes[slot]!=get_size(block)){
+                dbg_printf("\nThe block at %p is not in the fit index of list %d",block,index);
+                return false;
+            }
+            listed++;
+        }
+        if(listed!=fit->count){
+            dbg_printf("\nThe fit index of list %d holds %u blocks, not %u",index,fit->count,listed);
+            return false;
+        }
+     }
+//Checking the tree of large free blocks
+     if(a->tree_root!=NULL){
+        if(tree_is_red(a->tree_root)||check_tree(a,a->tree_root,NULL,&blocks_in_list)<0){
+            dbg_printf("\nLine Number %d : The tree of free blocks is inconsistent",lineno);
+            return false;
+        }
+     }
         if(blocks_in_heap!=blocks_in_list)
             {dbg_printf("\nThe value of list count is %d and value of blocks in heap is %d",
                 blocks_in_list,blocks_in_heap);
@@ -896,29 +5200,29 @@ bool mm_checkheap(int lineno)
 
 //Checking for pointers consistency in the heap checker  
 index=0;
-while(index<5){
-        if(tail[index]!=NULL)
+while(index<NUM_LISTS){
+        if(a->tail[index]!=NULL)
             { prev=NULL;
-            for (block = tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[0]))
+            for (block = a->tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[0]))
                 {
                    prev=block; 
                     
                 }
-                if(prev!=free_list[index])
+                if(prev!=a->free_list[index])
                 {
-                    dbg_printf("\nHeader not reachable from tail in the the list at index %d",index);
+                    dbg_printf("\nHeader not reachable from a->tail in the the list at index %d",index);
                     return false;
                 }
 
             } 
-        if(free_list[index]!=NULL)
+        if(a->free_list[index]!=NULL)
             { next=NULL;
-            for (block = tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[1]))
+            for (block = a->tail[index];block!=NULL;block = (block_t *)(((word_t *) block->payload)[1]))
                 {
                    next=block; 
                     
                 }
-                if(next!=tail[index])
+                if(next!=a->tail[index])
                 {
                     dbg_printf("\nTail not reachable from head in the the list at index %d",index);
                     return false;
@@ -934,6 +5238,71 @@ while(index<5){
 return true;
 }
 
+/* check_tree: checks the subtree of a at block: its parent link, order,
+ *             colours, and that it holds free blocks of tree sizes only.
+ *             Adds its nodes to count and returns its black height, or
+ *             -1 if it is inconsistent.
+ */
+static int check_tree(arena_t *a, block_t *block, block_t *parent, int *count)
+{
+    if(block==NULL)
+        return 0;
+    block_t *left=*tree_child(block,0),*right=*tree_child(block,1);
+    if(tree_parent(block)!=parent||!arena_contains(a,block)||get_alloc(block)
+       ||get_index(get_size(block))<a->tree_index){
+        dbg_printf("\nThe tree node at %p is misplaced",block);
+        return -1;
+    }
+    if((left!=NULL&&!tree_less(left,block))||(right!=NULL&&!tree_less(block,right))){
+        dbg_printf("\nThe tree is out of order at %p",block);
+        return -1;
+    }
+    if(tree_is_red(block)&&(tree_is_red(left)||tree_is_red(right))){
+        dbg_printf("\nThe red tree node at %p has a red child",block);
+        return -1;
+    }
+    int left_height=check_tree(a,left,block,count);
+    int right_height=check_tree(a,right,block,count);
+    if(left_height<0||left_height!=right_height){
+        dbg_printf("\nThe black heights differ under %p",block);
+        return -1;
+    }
+    (*count)++;
+    return left_height+(tree_is_red(block)?0:1);
+}
+
+/* print_list: prints every free block of every arena to stderr, list by
+ *             list, then the tree of large free blocks in order.
+ */
+static void print_list(void)
+{
+    block_t *block;
+
+    pthread_mutex_lock(&arenas_lock);
+    for(int i=0;i<ARENA_MAX;i++){
+        arena_t *a=arenas[i];
+        if(a==NULL||a->heap_listp==NULL)
+            continue;
+        pthread_mutex_lock(&a->lock);
+        fprintf(stderr,"arena %d at %p, %d free blocks\n",i,(void *)a,a->free_blocks);
+        for(int index=0;index<NUM_LISTS;index++){
+            if(a->free_list[index]==NULL)
+                continue;
+            fprintf(stderr,"  list %d:",index);
+            for(block=a->free_list[index];block!=NULL;block=(block_t *)(((word_t *)block->payload)[1]))
+                fprintf(stderr," %p(%zu)",(void *)block,get_size(block));
+            fprintf(stderr,"\n");
+        }
+        if(a->tree_root!=NULL){
+            fprintf(stderr,"  tree:");
+            for(block=tree_find(a,0,true);block!=NULL;block=tree_next(block))
+                fprintf(stderr," %p(%zu)",(void *)block,get_size(block));
+            fprintf(stderr,"\n");
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
 
 
 
@@ -0,0 +1,534 @@
+/*
+ * mmbench: replays allocation traces against the allocator in mm.c and
+ * against the C library's malloc, and reports throughput and space
+ * utilization for each.
+ *
+ * Traces use the malloc lab format: four header numbers (suggested heap
+ * size, which is ignored, number of block ids, number of operations and
+ * weight, also ignored), then one operation per line:
+ *     a <id> <size>    allocate size bytes as block id
+ *     r <id> <size>    reallocate block id to size bytes
+ *     f <id>           free block id
+ * tracegen.c writes synthetic traces in this format.
+ *
+ * Build from the directory holding mm.c, memlib.c and the handout headers:
+ *     gcc -O2 -DDRIVER -I. -pthread -o mmbench bench/mmbench.c mm.c memlib.c
+ * Usage:
+ *     mmbench [-i iterations] [-m] [-s] trace...
+ *     -i  times each trace is replayed for timing (default 5)
+ *     -m  only run mm.c
+ *     -s  only run the system malloc
+ *
+ * Throughput is the best of the timed replays, in operations per second.
+ * Utilization is the peak of the bytes requested by live blocks over the
+ * peak footprint: the heap of every arena, the slabs and the mapped
+ * blocks, sampled after every allocation in a separate, untimed replay.
+ * The peak of mem_heap_hi() - mem_heap_lo() is the part of that footprint
+ * obtained through mem_sbrk. The C library heap cannot be reset, so each
+ * trace is run against it in a child process of its own, starting from the
+ * same heap; its footprint is the heap size beyond the bytes in use when
+ * the child starts, free memory kept from earlier work counting in it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+typedef enum op_type
+{
+    OP_ALLOC,
+    OP_REALLOC,
+    OP_FREE
+} op_type_t;
+
+typedef struct op
+{
+    op_type_t type;
+    int id;
+    size_t size;
+} op_t;
+
+typedef struct trace
+{
+    const char *name;
+    int num_ids;
+    int num_ops;
+    op_t *ops;
+} trace_t;
+
+/* The allocator under test */
+typedef struct allocator
+{
+    const char *name;
+    void (*reset)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    size_t (*footprint)(void);
+} allocator_t;
+
+typedef struct result
+{
+    double ops_per_sec;
+    size_t peak_payload;
+    size_t peak_footprint;
+    size_t peak_sbrk;//0 if not applicable
+    bool done;//Set by a child process that ran to the end
+} result_t;
+
+static bool read_trace(const char *name, trace_t *trace);
+static void free_trace(trace_t *trace);
+static bool run_trace(const allocator_t *alloc, const trace_t *trace, void **blocks,
+                      size_t *sizes, int iterations, result_t *result);
+static bool run_forked(const allocator_t *alloc, const trace_t *trace, void **blocks,
+                       size_t *sizes, int iterations, result_t *result);
+static bool replay(const allocator_t *alloc, const trace_t *trace, void **blocks,
+                   size_t *sizes, bool measure, result_t *result);
+static double now_sec(void);
+static void mm_reset(void);
+static void libc_reset(void);
+static void *libc_malloc(size_t size);
+static void libc_free(void *ptr);
+static void *libc_realloc(void *ptr, size_t size);
+static size_t libc_footprint(void);
+
+static size_t libc_base;//Bytes the C library heap had in use at the start of a replay
+
+static const allocator_t mm_allocator =
+{
+    "mm", mm_reset, mm_malloc, mm_free, mm_realloc, mm_footprint
+};
+
+static const allocator_t libc_allocator =
+{
+    "libc", libc_reset, libc_malloc, libc_free, libc_realloc, libc_footprint
+};
+
+int main(int argc, char **argv)
+{
+    int iterations = 5;
+    bool run_mm = true;
+    bool run_libc = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:ms")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'm':
+            run_libc = false;
+            break;
+        case 's':
+            run_mm = false;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i iterations] [-m] [-s] trace...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc || iterations < 1)
+    {
+        fprintf(stderr, "usage: %s [-i iterations] [-m] [-s] trace...\n", argv[0]);
+        return 2;
+    }
+
+    mem_init();
+    printf("%-24s %-5s %10s %12s %12s %12s %7s\n", "trace", "alloc", "ops",
+           "Kops/s", "peak heap", "footprint", "util");
+    for (int t = optind; t < argc; t++)
+    {
+        trace_t trace;
+        if (!read_trace(argv[t], &trace))
+        {
+            return 1;
+        }
+        void **blocks = calloc(trace.num_ids, sizeof(*blocks));
+        size_t *sizes = calloc(trace.num_ids, sizeof(*sizes));
+        if (blocks == NULL || sizes == NULL)
+        {
+            fprintf(stderr, "%s: out of memory\n", trace.name);
+            return 1;
+        }
+
+        for (int a = 0; a < 2; a++)
+        {
+            const allocator_t *alloc = (a == 0) ? &mm_allocator : &libc_allocator;
+            result_t result;
+            if ((a == 0 && !run_mm) || (a == 1 && !run_libc))
+            {
+                continue;
+            }
+            // mm.c starts over at every replay, the C library only in a child
+            bool ok = (a == 0)
+                      ? run_trace(alloc, &trace, blocks, sizes, iterations, &result)
+                      : run_forked(alloc, &trace, blocks, sizes, iterations, &result);
+            if (!ok)
+            {
+                return 1;
+            }
+
+            printf("%-24s %-5s %10d %12.0f", trace.name, alloc->name, trace.num_ops,
+                   result.ops_per_sec / 1000);
+            if (result.peak_sbrk > 0)
+            {
+                printf(" %12zu", result.peak_sbrk);
+            }
+            else
+            {
+                printf(" %12s", "-");
+            }
+            if (result.peak_footprint > 0)
+            {
+                printf(" %12zu %6.1f%%\n", result.peak_footprint,
+                       100.0 * result.peak_payload / result.peak_footprint);
+            }
+            else
+            {
+                printf(" %12s %7s\n", "-", "-");
+            }
+        }
+        free(blocks);
+        free(sizes);
+        free_trace(&trace);
+    }
+    return 0;
+}
+
+/*
+ * read_trace: parses the trace file name into trace. Returns false, after
+ *             printing why, if it cannot be read or is malformed.
+ */
+static bool read_trace(const char *name, trace_t *trace)
+{
+    FILE *file = fopen(name, "r");
+    long heap_size, weight;
+    char type;
+
+    if (file == NULL)
+    {
+        perror(name);
+        return false;
+    }
+    trace->name = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    if (fscanf(file, "%ld %d %d %ld", &heap_size, &trace->num_ids,
+               &trace->num_ops, &weight) != 4
+        || trace->num_ids < 0 || trace->num_ops < 0)
+    {
+        fprintf(stderr, "%s: bad header\n", name);
+        fclose(file);
+        return false;
+    }
+    trace->ops = calloc(trace->num_ops, sizeof(op_t));
+    if (trace->ops == NULL && trace->num_ops > 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", name);
+        fclose(file);
+        return false;
+    }
+
+    for (int i = 0; i < trace->num_ops; i++)
+    {
+        op_t *op = &trace->ops[i];
+        int fields;
+        if (fscanf(file, " %c %d", &type, &op->id) != 2)
+        {
+            fprintf(stderr, "%s: operation %d is truncated\n", name, i);
+            goto fail;
+        }
+        switch (type)
+        {
+        case 'a':
+            op->type = OP_ALLOC;
+            fields = fscanf(file, "%zu", &op->size);
+            break;
+        case 'r':
+            op->type = OP_REALLOC;
+            fields = fscanf(file, "%zu", &op->size);
+            break;
+        case 'f':
+            op->type = OP_FREE;
+            fields = 1;
+            break;
+        default:
+            fields = 0;
+            break;
+        }
+        if (fields != 1 || op->id < 0 || op->id >= trace->num_ids)
+        {
+            fprintf(stderr, "%s: operation %d is malformed\n", name, i);
+            goto fail;
+        }
+    }
+    fclose(file);
+    return true;
+
+fail:
+    free(trace->ops);
+    fclose(file);
+    return false;
+}
+
+/*
+ * free_trace: releases the operations of trace.
+ */
+static void free_trace(trace_t *trace)
+{
+    free(trace->ops);
+    trace->ops = NULL;
+}
+
+/*
+ * run_trace: replays trace against alloc once to measure it and iterations
+ *            times to time it, filling in result. Returns false if a
+ *            replay fails.
+ */
+static bool run_trace(const allocator_t *alloc, const trace_t *trace, void **blocks,
+                      size_t *sizes, int iterations, result_t *result)
+{
+    result_t timed;
+
+    if (!replay(alloc, trace, blocks, sizes, true, result))
+    {
+        return false;
+    }
+    result->ops_per_sec = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        if (!replay(alloc, trace, blocks, sizes, false, &timed))
+        {
+            return false;
+        }
+        if (timed.ops_per_sec > result->ops_per_sec)
+        {
+            result->ops_per_sec = timed.ops_per_sec;
+        }
+    }
+    return true;
+}
+
+/*
+ * run_forked: does run_trace in a child process, so that the allocator's
+ *             state afterwards does not carry over to the next trace.
+ *             Returns false if the child fails.
+ */
+static bool run_forked(const allocator_t *alloc, const trace_t *trace, void **blocks,
+                       size_t *sizes, int iterations, result_t *result)
+{
+    result_t *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int status;
+    bool ok;
+
+    if (shared == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+    memset(shared, 0, sizeof(*shared));
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        munmap(shared, sizeof(*shared));
+        return false;
+    }
+    if (pid == 0)
+    {
+        shared->done = run_trace(alloc, trace, blocks, sizes, iterations, shared);
+        _exit(shared->done ? 0 : 1);
+    }
+    ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+         && WEXITSTATUS(status) == 0 && shared->done;
+    *result = *shared;
+    munmap(shared, sizeof(*shared));
+    return ok;
+}
+
+/*
+ * replay: runs trace against alloc from a fresh heap. Without measure,
+ *         the replay is timed and result->ops_per_sec set; with it, the
+ *         payload and footprint peaks are sampled after every allocation
+ *         instead. Blocks still live at the end are freed, untimed, after
+ *         which mm.c's statistics must show nothing allocated. Returns
+ *         false if an allocation fails or they do not.
+ */
+static bool replay(const allocator_t *alloc, const trace_t *trace, void **blocks,
+                   size_t *sizes, bool measure, result_t *result)
+{
+    size_t payload = 0;
+    double start;
+
+    memset(result, 0, sizeof(*result));
+    memset(blocks, 0, trace->num_ids * sizeof(*blocks));
+    memset(sizes, 0, trace->num_ids * sizeof(*sizes));
+    alloc->reset();
+
+    start = now_sec();
+    for (int i = 0; i < trace->num_ops; i++)
+    {
+        const op_t *op = &trace->ops[i];
+        void *bp;
+        switch (op->type)
+        {
+        case OP_ALLOC:
+            bp = alloc->malloc(op->size);
+            if (bp == NULL && op->size > 0)
+            {
+                fprintf(stderr, "%s: %s failed to allocate %zu bytes at op %d\n",
+                        trace->name, alloc->name, op->size, i);
+                return false;
+            }
+            blocks[op->id] = bp;
+            payload += op->size;
+            sizes[op->id] = op->size;
+            break;
+        case OP_REALLOC:
+            bp = alloc->realloc(blocks[op->id], op->size);
+            if (bp == NULL && op->size > 0)
+            {
+                fprintf(stderr, "%s: %s failed to reallocate %zu bytes at op %d\n",
+                        trace->name, alloc->name, op->size, i);
+                return false;
+            }
+            blocks[op->id] = bp;
+            payload += op->size - sizes[op->id];
+            sizes[op->id] = op->size;
+            break;
+        case OP_FREE:
+            alloc->free(blocks[op->id]);
+            blocks[op->id] = NULL;
+            payload -= sizes[op->id];
+            sizes[op->id] = 0;
+            continue;
+        }
+        if (measure)
+        {
+            size_t footprint = alloc->footprint();
+            if (payload > result->peak_payload)
+            {
+                result->peak_payload = payload;
+            }
+            if (footprint > result->peak_footprint)
+            {
+                result->peak_footprint = footprint;
+            }
+            if (alloc == &mm_allocator)
+            {
+                size_t sbrk = (char *)mem_heap_hi() - (char *)mem_heap_lo() + 1;
+                if (sbrk > result->peak_sbrk)
+                {
+                    result->peak_sbrk = sbrk;
+                }
+            }
+        }
+    }
+    if (!measure)
+    {
+        double elapsed = now_sec() - start;
+        result->ops_per_sec = (elapsed > 0) ? trace->num_ops / elapsed : 0;
+    }
+
+    for (int id = 0; id < trace->num_ids; id++)
+    {
+        alloc->free(blocks[id]);
+    }
+    if (alloc == &mm_allocator)
+    {
+        // Everything was freed, so the counters must balance again
+        mm_stats_t stats;
+        mm_stats(&stats);
+        if (stats.allocated != 0 || stats.nmalloc != stats.nfree)
+        {
+            fprintf(stderr, "%s: mm_stats reports %zu bytes in %lld blocks still allocated\n",
+                    trace->name, stats.allocated,
+                    (long long)(stats.nmalloc - stats.nfree));
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * now_sec: returns a monotonic time in seconds.
+ */
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * mm_reset: starts mm.c over on an empty sbrk heap.
+ */
+static void mm_reset(void)
+{
+    mem_reset_brk();
+    if (!mm_init())
+    {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+/*
+ * libc_reset: the C library heap cannot be reset; the bytes it has in use
+ *             already, the traces among others, are left out of its
+ *             footprint.
+ */
+static void libc_reset(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    libc_base = info.uordblks + info.hblkhd;
+#endif
+}
+
+static void *libc_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void libc_free(void *ptr)
+{
+    free(ptr);
+}
+
+static void *libc_realloc(void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+/*
+ * libc_footprint: returns the memory the C library heap holds beyond the
+ *                 bytes in use at libc_reset, where glibc reports it, else
+ *                 0, which disables utilization.
+ */
+static size_t libc_footprint(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    size_t size = info.arena + info.hblkhd;
+    return (size > libc_base) ? size - libc_base : 0;
+#else
+    return 0;
+#endif
+}
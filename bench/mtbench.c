@@ -0,0 +1,616 @@
+/*
+ * mtbench: multithreaded allocator benchmarks, run against mm.c and the
+ * C library's malloc over a sweep of thread counts.
+ *
+ * Benchmarks:
+ *     larson         server style: each thread replaces random blocks of a
+ *                    working set, then hands the set to a new thread, so
+ *                    blocks are freed by threads that did not allocate them
+ *     threadtest     each thread allocates a batch of small blocks and
+ *                    frees them all, over and over
+ *     xmalloc        each thread allocates blocks for its neighbour to free
+ *                    through a ring, so every free is a remote one
+ *     cache-scratch  each thread frees a block allocated next to the other
+ *                    threads' ones, then allocates, writes and frees a block
+ *                    of the same size repeatedly; an allocator that hands
+ *                    it the same cache line as another thread slows it down
+ *
+ * Build from the directory holding mm.c, memlib.c and the handout headers:
+ *     gcc -O2 -DDRIVER -I. -pthread -o mtbench bench/mtbench.c mm.c memlib.c
+ * Usage:
+ *     mtbench [-b benchmark] [-t threads] [-x scale] [-m] [-s]
+ *     -b  run only this benchmark (default all)
+ *     -t  largest thread count; the sweep doubles from 1 up to it
+ *         (default the number of online CPUs)
+ *     -x  multiplies the work of every thread (default 1)
+ *     -m  only run mm.c
+ *     -s  only run the system malloc
+ *
+ * The work per thread is fixed, so perfect scaling keeps the time constant
+ * and multiplies throughput by the thread count; speedup is throughput over
+ * that of one thread. Each run is a child process of its own, so the peak
+ * RSS reported for it (from wait4) covers that run alone.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+/* The allocator under test */
+typedef struct allocator
+{
+    const char *name;
+    bool (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+} allocator_t;
+
+typedef struct benchmark
+{
+    const char *name;
+    uint64_t (*run)(int threads);//Returns the number of mallocs and frees
+} benchmark_t;
+
+/* Filled in by the child process running a benchmark */
+typedef struct result
+{
+    bool done;
+    double seconds;
+    uint64_t ops;
+} result_t;
+
+/* Work per thread, multiplied by -x */
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 20000
+#define LARSON_GENERATIONS 10
+#define LARSON_MIN 16
+#define LARSON_MAX 512
+#define THREADTEST_OBJECTS 10000
+#define THREADTEST_ITERATIONS 50
+#define THREADTEST_SIZE 64
+#define XMALLOC_BLOCKS 500000
+#define XMALLOC_MIN 16
+#define XMALLOC_MAX 512
+#define SCRATCH_ITERATIONS 2000
+#define SCRATCH_WRITES 1000
+
+/* A larson working set, passed from thread to thread */
+typedef struct larson_set
+{
+    void **blocks;
+    unsigned int seed;
+    int generation;
+    pthread_t threads[LARSON_GENERATIONS];//threads[g + 1] is set by generation g
+} larson_set_t;
+
+/* An xmalloc ring: written by one thread, read by its neighbour */
+#define RING_SIZE 1024
+
+typedef struct ring
+{
+    void *slots[RING_SIZE];
+    uint64_t head __attribute__((aligned(64)));//Next slot to read
+    uint64_t tail __attribute__((aligned(64)));//Next slot to write
+} ring_t;
+
+typedef struct xmalloc_thread
+{
+    ring_t *produce;
+    ring_t *consume;
+    unsigned int seed;
+} xmalloc_thread_t;
+
+static bool run_benchmark(const benchmark_t *bench, const allocator_t *alloc,
+                          int threads, result_t *result, long *max_rss);
+static void spawn(int threads, void *(*worker)(void *), void *args, size_t arg_size);
+static double now_sec(void);
+static unsigned int next_random(unsigned int *seed);
+static uint64_t larson_run(int threads);
+static void *larson_worker(void *arg);
+static uint64_t threadtest_run(int threads);
+static void *threadtest_worker(void *arg);
+static uint64_t xmalloc_run(int threads);
+static void *xmalloc_worker(void *arg);
+static uint64_t scratch_run(int threads);
+static void *scratch_worker(void *arg);
+static bool mm_start(void);
+static bool libc_start(void);
+static void *libc_malloc(size_t size);
+static void libc_free(void *ptr);
+
+#define SCRATCH_SIZE 8
+
+static const allocator_t *allocator;//Used by the benchmark threads
+static long scale = 1;
+
+static const allocator_t mm_allocator =
+{
+    "mm", mm_start, mm_malloc, mm_free
+};
+
+static const allocator_t libc_allocator =
+{
+    "libc", libc_start, libc_malloc, libc_free
+};
+
+static const benchmark_t benchmarks[] =
+{
+    { "larson", larson_run },
+    { "threadtest", threadtest_run },
+    { "xmalloc", xmalloc_run },
+    { "cache-scratch", scratch_run }
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = (cpus > 0) ? (int)cpus : 1;
+    bool run_mm = true;
+    bool run_libc = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:t:x:ms")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            only = optarg;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'x':
+            scale = atol(optarg);
+            break;
+        case 'm':
+            run_libc = false;
+            break;
+        case 's':
+            run_mm = false;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b benchmark] [-t threads] [-x scale] [-m] [-s]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (max_threads < 1 || scale < 1)
+    {
+        fprintf(stderr, "usage: %s [-b benchmark] [-t threads] [-x scale] [-m] [-s]\n",
+                argv[0]);
+        return 2;
+    }
+
+    // Shared with the children, which cannot return results otherwise
+    result_t *result = mmap(NULL, sizeof(*result), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    bool found = false;
+    printf("%-14s %-5s %7s %10s %9s %10s\n", "benchmark", "alloc", "threads",
+           "Mops/s", "speedup", "max RSS MB");
+    for (size_t b = 0; b < NUM_BENCHMARKS; b++)
+    {
+        if (only != NULL && strcmp(only, benchmarks[b].name) != 0)
+        {
+            continue;
+        }
+        found = true;
+        for (int a = 0; a < 2; a++)
+        {
+            const allocator_t *alloc = (a == 0) ? &mm_allocator : &libc_allocator;
+            if ((a == 0) ? !run_mm : !run_libc)
+            {
+                continue;
+            }
+            double base = 0;
+            for (int threads = 1; ; threads = (2 * threads < max_threads) ? 2 * threads
+                                                                          : max_threads)
+            {
+                long max_rss;
+                if (!run_benchmark(&benchmarks[b], alloc, threads, result, &max_rss))
+                {
+                    fprintf(stderr, "%s: %s failed with %d threads\n", benchmarks[b].name,
+                            alloc->name, threads);
+                    return 1;
+                }
+                double rate = result->ops / result->seconds;
+                if (threads == 1)
+                {
+                    base = rate;
+                }
+                printf("%-14s %-5s %7d %10.2f %9.2f %10.1f\n", benchmarks[b].name,
+                       alloc->name, threads, rate / 1e6, rate / base, max_rss / 1024.0);
+                fflush(stdout);
+                if (threads == max_threads)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    if (!found)
+    {
+        fprintf(stderr, "unknown benchmark %s\n", only);
+        return 2;
+    }
+    return 0;
+}
+
+/*
+ * run_benchmark: runs bench on alloc with threads threads in a child
+ *                process. Returns false if the child fails, otherwise fills
+ *                in result and the child's peak RSS in KB.
+ */
+static bool run_benchmark(const benchmark_t *bench, const allocator_t *alloc,
+                          int threads, result_t *result, long *max_rss)
+{
+    memset(result, 0, sizeof(*result));
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0)
+    {
+        allocator = alloc;
+        if (!alloc->init())
+        {
+            _exit(1);
+        }
+        double start = now_sec();
+        result->ops = bench->run(threads);
+        result->seconds = now_sec() - start;
+        result->done = true;
+        _exit(0);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status)
+        || WEXITSTATUS(status) != 0 || !result->done)
+    {
+        return false;
+    }
+    *max_rss = usage.ru_maxrss;
+    return true;
+}
+
+/*
+ * spawn: runs worker on threads threads, the i-th one getting the i-th of
+ *        the arg_size byte arguments in args, and waits for them.
+ */
+static void spawn(int threads, void *(*worker)(void *), void *args, size_t arg_size)
+{
+    pthread_t *ids = malloc(threads * sizeof(*ids));
+
+    if (ids == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&ids[i], NULL, worker, (char *)args + i * arg_size) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+}
+
+/*
+ * now_sec: returns a monotonic time in seconds.
+ */
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * next_random: a small xorshift generator, so threads do not share the
+ *              state (or the lock) of rand().
+ */
+static unsigned int next_random(unsigned int *seed)
+{
+    unsigned int x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+/*
+ * larson_run: every working set goes through LARSON_GENERATIONS threads;
+ *             the main thread waits for the last one of each.
+ */
+static uint64_t larson_run(int threads)
+{
+    larson_set_t *sets = calloc(threads, sizeof(*sets));
+
+    if (sets == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        sets[i].blocks = calloc(LARSON_SLOTS, sizeof(void *));
+        sets[i].seed = 2 * i + 1;
+        if (sets[i].blocks == NULL
+            || pthread_create(&sets[i].threads[0], NULL, larson_worker, &sets[i]) != 0)
+        {
+            fprintf(stderr, "larson: cannot start thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        // Each generation starts the next before exiting, so joining
+        // generation g makes the id of g + 1 visible
+        for (int g = 0; g < LARSON_GENERATIONS; g++)
+        {
+            pthread_join(sets[i].threads[g], NULL);
+        }
+        for (int s = 0; s < LARSON_SLOTS; s++)
+        {
+            allocator->free(sets[i].blocks[s]);
+        }
+        free(sets[i].blocks);
+    }
+    free(sets);
+    return (uint64_t)threads * (LARSON_SLOTS + 2ull * LARSON_GENERATIONS * LARSON_ROUNDS
+                                * scale);
+}
+
+static void *larson_worker(void *arg)
+{
+    larson_set_t *set = arg;
+    void **blocks = set->blocks;
+
+    if (set->generation == 0)
+    {
+        for (int s = 0; s < LARSON_SLOTS; s++)
+        {
+            blocks[s] = allocator->malloc(LARSON_MIN);
+        }
+    }
+    for (long r = 0; r < LARSON_ROUNDS * scale; r++)
+    {
+        unsigned int x = next_random(&set->seed);
+        int s = x % LARSON_SLOTS;
+        size_t size = LARSON_MIN + (x >> 16) % (LARSON_MAX - LARSON_MIN + 1);
+        allocator->free(blocks[s]);
+        blocks[s] = allocator->malloc(size);
+        if (blocks[s] == NULL)
+        {
+            fprintf(stderr, "larson: out of memory\n");
+            exit(1);
+        }
+        *(char *)blocks[s] = (char)s;
+    }
+    if (++set->generation < LARSON_GENERATIONS)
+    {
+        if (pthread_create(&set->threads[set->generation], NULL, larson_worker, set) != 0)
+        {
+            fprintf(stderr, "larson: cannot start thread\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+static uint64_t threadtest_run(int threads)
+{
+    spawn(threads, threadtest_worker, NULL, 0);
+    return (uint64_t)threads * 2 * THREADTEST_OBJECTS * THREADTEST_ITERATIONS * scale;
+}
+
+static void *threadtest_worker(void *arg)
+{
+    void **blocks = malloc(THREADTEST_OBJECTS * sizeof(void *));
+
+    (void)arg;
+    if (blocks == NULL)
+    {
+        fprintf(stderr, "threadtest: out of memory\n");
+        exit(1);
+    }
+    for (long i = 0; i < THREADTEST_ITERATIONS * scale; i++)
+    {
+        for (int j = 0; j < THREADTEST_OBJECTS; j++)
+        {
+            blocks[j] = allocator->malloc(THREADTEST_SIZE);
+            if (blocks[j] == NULL)
+            {
+                fprintf(stderr, "threadtest: out of memory\n");
+                exit(1);
+            }
+            *(char *)blocks[j] = (char)j;
+        }
+        for (int j = 0; j < THREADTEST_OBJECTS; j++)
+        {
+            allocator->free(blocks[j]);
+        }
+    }
+    free(blocks);
+    return NULL;
+}
+
+/*
+ * xmalloc_run: thread i fills ring i and empties ring i + 1, so each ring
+ *              has a single writer and a single reader. A lone thread
+ *              empties its own ring.
+ */
+static uint64_t xmalloc_run(int threads)
+{
+    ring_t *rings = aligned_alloc(64, threads * sizeof(ring_t));
+    xmalloc_thread_t *args = malloc(threads * sizeof(*args));
+
+    if (rings == NULL || args == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(rings, 0, threads * sizeof(ring_t));
+    for (int i = 0; i < threads; i++)
+    {
+        args[i].produce = &rings[i];
+        args[i].consume = &rings[(i + 1) % threads];
+        args[i].seed = 2 * i + 1;
+    }
+    spawn(threads, xmalloc_worker, args, sizeof(*args));
+    free(args);
+    free(rings);
+    return (uint64_t)threads * 2 * XMALLOC_BLOCKS * scale;
+}
+
+static void *xmalloc_worker(void *arg)
+{
+    xmalloc_thread_t *self = arg;
+    ring_t *out = self->produce;
+    ring_t *in = self->consume;
+    long total = XMALLOC_BLOCKS * scale;
+    long produced = 0, consumed = 0;
+
+    // Both sides make progress in every pass, so neighbours never deadlock
+    while (produced < total || consumed < total)
+    {
+        long before = produced + consumed;
+        uint64_t head = __atomic_load_n(&out->head, __ATOMIC_ACQUIRE);
+        while (produced < total && out->tail - head < RING_SIZE)
+        {
+            size_t size = XMALLOC_MIN + next_random(&self->seed)
+                                        % (XMALLOC_MAX - XMALLOC_MIN + 1);
+            void *bp = allocator->malloc(size);
+            if (bp == NULL)
+            {
+                fprintf(stderr, "xmalloc: out of memory\n");
+                exit(1);
+            }
+            *(char *)bp = (char)size;
+            out->slots[out->tail % RING_SIZE] = bp;
+            __atomic_store_n(&out->tail, out->tail + 1, __ATOMIC_RELEASE);
+            produced++;
+        }
+
+        uint64_t tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+        while (in->head < tail)
+        {
+            allocator->free(in->slots[in->head % RING_SIZE]);
+            __atomic_store_n(&in->head, in->head + 1, __ATOMIC_RELEASE);
+            consumed++;
+        }
+        if (produced + consumed == before)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * scratch_run: the blocks handed to the threads are allocated back to back
+ *              by the main thread, so they likely share cache lines.
+ */
+static uint64_t scratch_run(int threads)
+{
+    void **blocks = malloc(threads * sizeof(void *));
+
+    if (blocks == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        blocks[i] = allocator->malloc(SCRATCH_SIZE);
+        if (blocks[i] == NULL)
+        {
+            fprintf(stderr, "cache-scratch: out of memory\n");
+            exit(1);
+        }
+    }
+    spawn(threads, scratch_worker, blocks, sizeof(void *));
+    free(blocks);
+    return (uint64_t)threads * (1 + 2 * SCRATCH_ITERATIONS * scale);
+}
+
+static void *scratch_worker(void *arg)
+{
+    allocator->free(*(void **)arg);
+    for (long i = 0; i < SCRATCH_ITERATIONS * scale; i++)
+    {
+        volatile char *bp = allocator->malloc(SCRATCH_SIZE);
+        if (bp == NULL)
+        {
+            fprintf(stderr, "cache-scratch: out of memory\n");
+            exit(1);
+        }
+        for (int w = 0; w < SCRATCH_WRITES; w++)
+        {
+            for (int k = 0; k < SCRATCH_SIZE; k++)
+            {
+                bp[k] = (char)(bp[k] + 1);
+            }
+        }
+        allocator->free((void *)bp);
+    }
+    return NULL;
+}
+
+/*
+ * mm_start: sets up the sbrk heap and mm.c in a fresh child.
+ */
+static bool mm_start(void)
+{
+    mem_init();
+    return mm_init();
+}
+
+static bool libc_start(void)
+{
+    return true;
+}
+
+static void *libc_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void libc_free(void *ptr)
+{
+    free(ptr);
+}
@@ -0,0 +1,258 @@
+/*
+ * tracegen: writes a synthetic allocation trace in the malloc lab format
+ * read by mmbench to standard output.
+ *
+ * Build: gcc -O2 -o tracegen bench/tracegen.c -lm
+ * Usage:
+ *     tracegen [-n allocs] [-d dist] [-m min] [-M max] [-l live]
+ *              [-o order] [-r percent] [-s seed] > trace.rep
+ *     -n  number of allocations (default 10000)
+ *     -d  size distribution (default uniform):
+ *           uniform  every size from min to max equally likely
+ *           exp      exponential with mean (max - min) / 8 above min
+ *           pow2     powers of two from min to max, equally likely
+ *           pareto   power law with shape 1.5 from min, mostly small
+ *           bimodal  90% from min to 8 * min, 10% from max / 2 to max
+ *     -m  smallest size (default 1)
+ *     -M  largest size (default 4096)
+ *     -l  blocks live at most at once (default 1000)
+ *     -o  which live block a free picks (default random):
+ *           random, lifo (the newest) or fifo (the oldest)
+ *     -r  percentage of frees turned into reallocs to a new size (default 0)
+ *     -s  random seed (default 1)
+ * Every block is freed by the end of the trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+
+typedef enum dist
+{
+    DIST_UNIFORM,
+    DIST_EXP,
+    DIST_POW2,
+    DIST_PARETO,
+    DIST_BIMODAL
+} dist_t;
+
+typedef enum order
+{
+    ORDER_RANDOM,
+    ORDER_LIFO,
+    ORDER_FIFO
+} order_t;
+
+typedef struct op
+{
+    char type;
+    int id;
+    size_t size;
+} op_t;
+
+static const char *dist_names[] = { "uniform", "exp", "pow2", "pareto", "bimodal" };
+static const char *order_names[] = { "random", "lifo", "fifo" };
+
+static size_t draw_size(dist_t dist, size_t min, size_t max);
+static size_t draw_range(size_t lo, size_t hi);
+static int lookup(const char *name, const char **names, int count);
+
+int main(int argc, char **argv)
+{
+    long allocs = 10000;
+    dist_t dist = DIST_UNIFORM;
+    size_t min = 1, max = 4096;
+    long live_max = 1000;
+    order_t order = ORDER_RANDOM;
+    int realloc_percent = 0;
+    long seed = 1;
+    int opt, index;
+
+    while ((opt = getopt(argc, argv, "n:d:m:M:l:o:r:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            allocs = atol(optarg);
+            break;
+        case 'd':
+            if ((index = lookup(optarg, dist_names, 5)) < 0)
+            {
+                fprintf(stderr, "unknown distribution %s\n", optarg);
+                return 2;
+            }
+            dist = (dist_t)index;
+            break;
+        case 'm':
+            min = strtoul(optarg, NULL, 0);
+            break;
+        case 'M':
+            max = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            live_max = atol(optarg);
+            break;
+        case 'o':
+            if ((index = lookup(optarg, order_names, 3)) < 0)
+            {
+                fprintf(stderr, "unknown order %s\n", optarg);
+                return 2;
+            }
+            order = (order_t)index;
+            break;
+        case 'r':
+            realloc_percent = atoi(optarg);
+            break;
+        case 's':
+            seed = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n allocs] [-d dist] [-m min] [-M max] [-l live]"
+                    " [-o order] [-r percent] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (allocs < 1 || min < 1 || max < min || live_max < 1
+        || realloc_percent < 0 || realloc_percent > 100)
+    {
+        fprintf(stderr, "bad parameters\n");
+        return 2;
+    }
+    srand48(seed);
+
+    // Every allocation gets an id of its own, freed in the same trace
+    long cap = 2 * allocs;
+    op_t *ops = malloc(cap * sizeof(op_t));
+    int *live = malloc(live_max * sizeof(int));
+    long nops = 0, nlive = 0, next_id = 0;
+    if (ops == NULL || live == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    while (next_id < allocs || nlive > 0)
+    {
+        if (nops == cap)
+        {
+            op_t *grown = realloc(ops, 2 * cap * sizeof(op_t));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+            ops = grown;
+            cap *= 2;
+        }
+
+        bool alloc = next_id < allocs && nlive < live_max
+                     && (nlive == 0 || drand48() < 0.5);
+        if (alloc)
+        {
+            ops[nops++] = (op_t){ 'a', (int)next_id, draw_size(dist, min, max) };
+            live[nlive++] = (int)next_id++;
+            continue;
+        }
+
+        long victim;
+        switch (order)
+        {
+        case ORDER_LIFO:
+            victim = nlive - 1;
+            break;
+        case ORDER_FIFO:
+            victim = 0;
+            break;
+        default:
+            victim = lrand48() % nlive;
+            break;
+        }
+        // Reallocs are only drawn while allocations remain, so traces end
+        if (next_id < allocs && lrand48() % 100 < realloc_percent)
+        {
+            ops[nops++] = (op_t){ 'r', live[victim], draw_size(dist, min, max) };
+            continue;
+        }
+        ops[nops++] = (op_t){ 'f', live[victim], 0 };
+        memmove(&live[victim], &live[victim + 1], (nlive - victim - 1) * sizeof(int));
+        nlive--;
+    }
+
+    printf("%zu\n%ld\n%ld\n1\n", max * live_max, next_id, nops);
+    for (long i = 0; i < nops; i++)
+    {
+        if (ops[i].type == 'f')
+        {
+            printf("f %d\n", ops[i].id);
+        }
+        else
+        {
+            printf("%c %d %zu\n", ops[i].type, ops[i].id, ops[i].size);
+        }
+    }
+    free(ops);
+    free(live);
+    return 0;
+}
+
+/*
+ * draw_size: returns a random request size between min and max from dist.
+ */
+static size_t draw_size(dist_t dist, size_t min, size_t max)
+{
+    double size;
+
+    switch (dist)
+    {
+    case DIST_EXP:
+        size = min - log(1.0 - drand48()) * (max - min) / 8;
+        break;
+    case DIST_POW2:
+    {
+        int lo = (int)ceil(log2((double)min));
+        int hi = (int)floor(log2((double)max));
+        if (hi < lo)
+        {
+            return min;
+        }
+        return (size_t)1 << draw_range(lo, hi);
+    }
+    case DIST_PARETO:
+        size = min / pow(1.0 - drand48(), 1 / 1.5);
+        break;
+    case DIST_BIMODAL:
+        if (drand48() < 0.9)
+        {
+            return draw_range(min, (8 * min < max) ? 8 * min : max);
+        }
+        return draw_range(max / 2 > min ? max / 2 : min, max);
+    default:
+        return draw_range(min, max);
+    }
+    return (size > max) ? max : (size_t)size;
+}
+
+/*
+ * draw_range: returns a uniformly random number from lo to hi.
+ */
+static size_t draw_range(size_t lo, size_t hi)
+{
+    return lo + (size_t)(drand48() * (hi - lo + 1));
+}
+
+/*
+ * lookup: returns the index of name in names, or -1.
+ */
+static int lookup(const char *name, const char **names, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
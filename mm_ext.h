@@ -0,0 +1,241 @@
+/*
+ * mm_ext.h: extensions to the allocator interface of mm.h, implemented
+ *           alongside it in mm.c.
+ */
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Parameters for mm_mallopt.
+ * MM_OPT_MMAP_THRESHOLD: requests of at least this many bytes get a
+ *                        mapping of their own. Setting it turns off the
+ *                        dynamic adjustment of the threshold.
+ * MM_OPT_TRIM_THRESHOLD: a free block at the top of an arena larger than
+ *                        this is cut back and its memory returned. Setting
+ *                        it also turns off the dynamic thresholds.
+ * MM_OPT_PURGE_THRESHOLD: pages inside free blocks of at least this many
+ *                         bytes are returned to the OS.
+ * MM_OPT_DIRTY_DECAY_MS: milliseconds such memory stays free before it is
+ *                        returned; 0 (the default) returns it on free.
+ * MM_OPT_BACKGROUND_THREAD: non zero starts a thread that returns decayed
+ *                           memory off the allocation path, 0 stops it.
+ * MM_OPT_FIT_POLICY: one of the MM_FIT_ policies below. An arena keeps the
+ *                    policy it was initialized with, so this takes effect
+ *                    at the next mm_init (and for arenas created later).
+ * MM_OPT_PROF_SAMPLE: mean number of bytes allocated between samples of
+ *                     the heap profiler (see mm_prof_dump), 0 (the
+ *                     default) turns sampling off. 512 KiB keeps the
+ *                     overhead well under 1%.
+ * MM_OPT_HEAP_GROW_MAX: largest step by which an arena's heap grows. Steps
+ *                       double from 4 KiB up to it (and to an eighth of the
+ *                       heap); 8 MiB by default, 0 always grows by 4 KiB.
+ * MM_OPT_PREFAULT: non zero backs heap memory and mapped blocks with pages
+ *                  as soon as they are added, so that first touches do not
+ *                  fault, 0 (the default) leaves that to the first touch.
+ * MM_OPT_HUGE_PAGES: non zero lays out memory for transparent huge pages:
+ *                    heap growth of 2 MiB or more ends on 2 MiB boundaries,
+ *                    the heap and mapped blocks are advised MADV_HUGEPAGE
+ *                    and free memory is given back in whole 2 MiB pages.
+ */
+#define MM_OPT_MMAP_THRESHOLD 1
+#define MM_OPT_TRIM_THRESHOLD 2
+#define MM_OPT_PURGE_THRESHOLD 3
+#define MM_OPT_DIRTY_DECAY_MS 4
+#define MM_OPT_BACKGROUND_THREAD 5
+#define MM_OPT_FIT_POLICY 6
+#define MM_OPT_PROF_SAMPLE 7
+#define MM_OPT_HEAP_GROW_MAX 8
+#define MM_OPT_PREFAULT 9
+#define MM_OPT_HUGE_PAGES 10
+
+/*
+ * Fit policies.
+ * MM_FIT_FIRST: every free block is on the segregated lists; a request
+ *               takes the first block of the first class that fits (the
+ *               default, fastest).
+ * MM_FIT_BEST: large free blocks are kept in a tree ordered by size and
+ *              address; a request takes the smallest one that fits.
+ * MM_FIT_ADDRESS_BEST: as MM_FIT_BEST, preferring the lowest address
+ *                      among blocks of that size (least fragmentation).
+ */
+#define MM_FIT_FIRST 0
+#define MM_FIT_BEST 1
+#define MM_FIT_ADDRESS_BEST 2
+
+/*
+ * mm_mallopt: sets allocator parameter param to value. Returns false if
+ *             param is unknown or value is out of range.
+ */
+extern bool mm_mallopt(int param, size_t value);
+
+/*
+ * mm_purge_now: returns the memory of all large free blocks to the OS
+ *               without waiting for it to decay.
+ */
+extern void mm_purge_now(void);
+
+/*
+ * Aligned allocation. Each returns (or stores in *memptr) a block whose
+ * address is a multiple of alignment, freed with mm_free like any other.
+ * mm_posix_memalign: alignment must be a power of two multiple of
+ *                    sizeof(void *); returns 0, EINVAL or ENOMEM.
+ * mm_aligned_alloc: alignment must be a power of two, else NULL (EINVAL).
+ * mm_memalign: rounds alignment up to a power of two.
+ * mm_valloc: aligns to a page.
+ * mm_pvalloc: aligns to a page and rounds size up to whole pages.
+ */
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+
+/*
+ * Sized deallocation. size must be the size the block was allocated, or
+ * last reallocated, with (and alignment the one it was allocated with);
+ * slab objects are then freed without reading their slab header.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
+extern void mm_free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+/*
+ * mm_malloc_usable_size: returns the number of bytes usable at ptr, which
+ *                        may exceed the size it was allocated with; 0 for
+ *                        NULL.
+ */
+extern size_t mm_malloc_usable_size(void *ptr);
+
+/*
+ * mm_malloc_batch: allocates up to n blocks of size bytes each into ptrs,
+ *                  carved out of as few free blocks as possible. Returns
+ *                  the number allocated, fewer than n only if memory ran
+ *                  out.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/*
+ * mm_free_batch: frees the n blocks in ptrs (NULL entries are skipped),
+ *                coalescing neighbouring blocks together. ptrs is sorted
+ *                by address in the process. A merged run that reaches
+ *                the purge or trim threshold is released at once unless
+ *                MM_OPT_DIRTY_DECAY_MS defers it.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/*
+ * Regions: objects bump allocated out of large heap chunks, freed all at
+ * once by resetting or destroying their region rather than one by one.
+ * A region is not thread safe; give each thread (or request) its own.
+ * mm_region_create: returns a new region allocating chunk_size byte chunks
+ *                   (0 for the default), or NULL if out of memory.
+ * mm_region_alloc: returns size bytes aligned like mm_malloc's, or NULL.
+ *                  Objects must not be passed to mm_free.
+ * mm_region_reset: frees every object of the region, keeping its chunks
+ *                  for the allocations that follow.
+ * mm_region_destroy: frees the region and all its memory.
+ */
+typedef struct mm_region mm_region_t;
+
+extern mm_region_t *mm_region_create(size_t chunk_size);
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+extern void mm_region_reset(mm_region_t *region);
+extern void mm_region_destroy(mm_region_t *region);
+
+/*
+ * Statistics, filled in by mm_stats. Free blocks are counted per bucket,
+ * bucket b holding the free heap blocks of 2^b to 2^(b+1) - 1 bytes (the
+ * first level of the segregated lists).
+ */
+#define MM_STATS_BUCKETS 64
+
+typedef struct mm_stats
+{
+    size_t allocated;    /* Bytes usable in blocks the program holds */
+    uint64_t nmalloc;    /* Allocations, including calloc and moving realloc */
+    uint64_t nfree;      /* Frees, likewise */
+    size_t heap_size;    /* Bytes of heap over all arenas */
+    size_t slab_size;    /* Bytes of slabs carved so far */
+    size_t mapped;       /* Bytes in blocks with a mapping of their own */
+    size_t free_bytes;   /* Bytes in free heap blocks */
+    size_t free_blocks;
+    size_t largest_free; /* Size of the largest free heap block */
+    double fragmentation;/* 1 - largest_free / free_bytes, 0 if nothing is free */
+    size_t fast_bytes;   /* Bytes in fast bin blocks, not counted as free above */
+    size_t remote_bytes; /* Bytes freed by other threads, not yet returned */
+    size_t bucket_blocks[MM_STATS_BUCKETS];
+    size_t bucket_bytes[MM_STATS_BUCKETS];
+    uint64_t extend_heap;/* Times an arena's heap was grown */
+    uint64_t splits;     /* Free blocks split to place an allocation */
+    uint64_t coalesce[4];/* Coalescing by free neighbours: none, next, prev, both */
+} mm_stats_t;
+
+/*
+ * mm_stats: fills in stats. Counters are gathered from every arena and
+ *           thread, so this is meant for monitoring, not hot paths. It
+ *           only reads: fast bins and remote frees are counted as they
+ *           are, not coalesced into the free blocks.
+ */
+extern void mm_stats(mm_stats_t *stats);
+
+/*
+ * mm_footprint: returns the bytes the allocator holds for the heaps of all
+ *               arenas, slabs and mapped blocks (heap_size + slab_size +
+ *               mapped of mm_stats) without changing any of its state;
+ *               cheap enough to sample after every allocation.
+ */
+extern size_t mm_footprint(void);
+
+/*
+ * mm_stats_print: prints the statistics to stderr; with lists set, every
+ *                 free block of every arena as well.
+ */
+extern void mm_stats_print(bool lists);
+
+/*
+ * mm_prof_dump: writes the heap profile sampled so far to path, in the
+ *               gperftools heap profile format pprof reads: for every
+ *               sampled call stack, the sampled objects and bytes still
+ *               allocated and ever allocated. Returns false if path could
+ *               not be written.
+ */
+extern bool mm_prof_dump(const char *path);
+
+/*
+ * Latency histograms, kept when mm.c is built with LATENCY_HIST. Calls of
+ * each op are counted in bucket b if they took 2^b to 2^(b+1) - 1 cycles
+ * of the CPU's cycle counter (bucket 0 also holds 0). The phases are
+ * timed inside the calls, so they overlap the call histograms, and a
+ * realloc that moves counts its malloc and free as well.
+ */
+#define MM_LAT_MALLOC 0
+#define MM_LAT_FREE 1
+#define MM_LAT_REALLOC 2
+#define MM_LAT_CALLOC 3
+#define MM_LAT_FIND_FIT 4    /* Free list or tree search for a fit */
+#define MM_LAT_COALESCE 5
+#define MM_LAT_EXTEND_HEAP 6 /* Growing an arena, including mem_sbrk */
+#define MM_LAT_OPS 7
+#define MM_LAT_BUCKETS 64
+
+typedef struct mm_latency
+{
+    uint64_t buckets[MM_LAT_OPS][MM_LAT_BUCKETS];
+} mm_latency_t;
+
+/*
+ * mm_latency: fills in latency, summed over all threads. Returns false
+ *             (with empty histograms) if mm.c was built without them.
+ */
+extern bool mm_latency(mm_latency_t *latency);
+
+/*
+ * mm_latency_print: prints the calls and p50, p99, p99.9 and maximum
+ *                   cycles of every op to stderr, with its histogram.
+ */
+extern void mm_latency_print(void);
+
+#endif /* MM_EXT_H */